@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <filesystem>
+#include <errno.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#include "asyncread.hpp"
+
+AsyncReader::~AsyncReader()
+{
+    close();
+}
+
+bool AsyncReader::open([[maybe_unused]] const std::filesystem::path &path)
+{
+#ifndef HAS_IO_URING
+    return false;
+#else
+    close();
+    if (io_uring_queue_init(ASYNC_QUEUE_DEPTH, &ring, 0) < 0)
+        return false;
+    ring_ready = true;
+    struct stat st;
+    if ((fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st)) {
+        close();
+        return false;
+    }
+    file_size = st.st_size;
+    pos = next = 0;
+    head = queued = 0;
+    for (Slot &slot : slots)
+        slot.data.resize(ASYNC_READ_SIZE);
+    submit();
+    return true;
+#endif
+}
+
+void AsyncReader::close()
+{
+#ifdef HAS_IO_URING
+    if (!ring_ready)
+        return;
+
+    // The buffers can't be freed while the kernel may still write to them
+    for (Slot &slot : slots)
+        wait(slot);
+    io_uring_queue_exit(&ring);
+    ring_ready = false;
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+#endif
+}
+
+// Fill the free slots with reads of the next parts of the file
+void AsyncReader::submit()
+{
+#ifdef HAS_IO_URING
+    bool submitted = false;
+    while (queued < ASYNC_QUEUE_DEPTH && next < file_size) {
+        Slot &slot = slots[(head + queued) % ASYNC_QUEUE_DEPTH];
+        io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+        if (!sqe)
+            break;
+        unsigned int length = (unsigned int) std::min<int64_t>(ASYNC_READ_SIZE, file_size - next);
+        io_uring_prep_read(sqe, fd, slot.data.data(), length, (uint64_t) next);
+        io_uring_sqe_set_data(sqe, &slot);
+        slot.offset = next;
+        slot.result = 0;
+        slot.pending = true;
+        next += length;
+        queued++;
+        submitted = true;
+    }
+    if (submitted)
+        io_uring_submit(&ring);
+#endif
+}
+
+// Reads complete in any order, so the completions of other slots are
+// recorded until the one of this slot arrives
+bool AsyncReader::wait([[maybe_unused]] Slot &slot)
+{
+#ifdef HAS_IO_URING
+    while (slot.pending) {
+        io_uring_cqe *cqe;
+        int rc = io_uring_wait_cqe(&ring, &cqe);
+        if (rc == -EINTR)
+            continue;
+        if (rc < 0)
+            return false;
+        Slot *done = static_cast<Slot*>(io_uring_cqe_get_data(cqe));
+        done->result = cqe->res;
+        done->pending = false;
+        io_uring_cqe_seen(&ring, cqe);
+    }
+#endif
+    return true;
+}
+
+// Drop the read-ahead window, and start a new one at offset
+void AsyncReader::restart(int64_t offset)
+{
+    for (Slot &slot : slots)
+        wait(slot);
+    head = queued = 0;
+    next = offset;
+    submit();
+}
+
+// Copy up to size bytes from pos. Returns the number of bytes, 0 at the end
+// of the file, or a negative error code
+int AsyncReader::read(uint8_t *buffer, size_t size)
+{
+    while (pos < file_size) {
+        if (!queued || pos < slots[head].offset || pos >= next)
+            restart(pos);
+        Slot &slot = slots[head];
+        if (!wait(slot))
+            return -EIO;
+        if (slot.result == -EAGAIN || slot.result == -EINTR) {
+            restart(slot.offset);
+            continue;
+        }
+        if (slot.result < 0)
+            return slot.result;
+        if (!slot.result)
+            return 0; // The file was truncated while it was read
+
+        int64_t offset = pos - slot.offset;
+        if (offset < slot.result) {
+            size_t length = std::min(size, (size_t) (slot.result - offset));
+            memcpy(buffer, slot.data.data() + offset, length);
+            pos += (int64_t) length;
+            return (int) length;
+        }
+
+        // The slot has been read, reuse it further ahead. After a short read,
+        // the next slot doesn't start at pos and a new window is started
+        head = (head + 1) % ASYNC_QUEUE_DEPTH;
+        queued--;
+        submit();
+    }
+    return 0;
+}
+
+bool AsyncReader::seek(int64_t offset)
+{
+    if (offset < 0 || offset > file_size)
+        return false;
+    pos = offset;
+    return true;
+}
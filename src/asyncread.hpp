@@ -0,0 +1,57 @@
+#pragma once
+
+#include <vector>
+#include <filesystem>
+#include <stdint.h>
+#include <stddef.h>
+#ifdef HAS_IO_URING
+#include <liburing.h>
+#endif
+
+#define ASYNC_READ_SIZE 1048576 // Bytes per read
+#define ASYNC_QUEUE_DEPTH 4     // Reads in flight per file
+
+// Reads a file ahead of the demuxer with io_uring. Several large reads are in
+// flight at a time, so a worker doesn't wait for a round trip to a network
+// filesystem on every read of FFmpeg. Reads that FFmpeg makes outside of the
+// read-ahead window, e.g. for the tags at the end of a file, start a new one.
+// open() returns false when io_uring can't be used: rsgain was built without
+// HAS_IO_URING, the kernel doesn't support it, or it's blocked, e.g. by a
+// container's seccomp profile. The file is then opened by FFmpeg instead
+class AsyncReader {
+    public:
+        AsyncReader() = default;
+        AsyncReader(const AsyncReader&) = delete;
+        AsyncReader& operator=(const AsyncReader&) = delete;
+        ~AsyncReader();
+        bool open(const std::filesystem::path &path);
+        int read(uint8_t *buffer, size_t size);
+        bool seek(int64_t offset);
+        int64_t position() const { return pos; }
+        int64_t size() const { return file_size; }
+
+    private:
+        struct Slot {
+            std::vector<uint8_t> data;
+            int64_t offset = 0;
+            int result = 0; // Bytes read, or a negative error code
+            bool pending = false;
+        };
+
+        int fd = -1;
+        int64_t file_size = 0;
+        int64_t pos = 0;  // Of the next byte that FFmpeg reads
+        int64_t next = 0; // Offset of the next read that is submitted
+        Slot slots[ASYNC_QUEUE_DEPTH];
+        size_t head = 0;   // Slot that holds pos, if any
+        size_t queued = 0; // Slots in use, starting from head
+#ifdef HAS_IO_URING
+        io_uring ring;
+        bool ring_ready = false;
+#endif
+
+        void submit();
+        bool wait(Slot &slot);
+        void restart(int64_t offset);
+        void close();
+};
@@ -0,0 +1,143 @@
+#include <cmath>
+#include <mutex>
+#include <string>
+#include <filesystem>
+#include <string_view>
+#include <stdio.h>
+
+#include "rsgain.hpp"
+#include "output.hpp"
+#include "json.hpp"
+#include "cache.hpp"
+
+LoudnessCache::~LoudnessCache()
+{
+    close();
+}
+
+// Load the results of previous runs, and start appending to the file
+bool LoudnessCache::open(const std::filesystem::path &path)
+{
+    this->path = path;
+    bool exists = std::filesystem::exists(path);
+    if (exists && !load())
+        return false;
+    if (!(stream = fopen(path.string().c_str(), "ab"))) {
+        output_fail("Could not open cache file '{}'", path.string());
+        return false;
+    }
+    if (!exists || !std::filesystem::file_size(path)) {
+        rsgain::print(stream, "{{\"cache\":{}}}\n", CACHE_VERSION);
+        if (fflush(stream)) {
+            output_fail("Could not write cache file '{}'", path.string());
+            return false;
+        }
+    }
+    return true;
+}
+
+bool LoudnessCache::load()
+{
+    std::FILE *file = fopen(path.string().c_str(), "rb");
+    if (!file) {
+        output_fail("Could not open cache file '{}'", path.string());
+        return false;
+    }
+    std::string content;
+    char buffer[65536];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file)))
+        content.append(buffer, size);
+    fclose(file);
+    if (content.empty())
+        return true;
+
+    json::Value value;
+    std::string error;
+    size_t end = content.find('\n');
+    const json::Value *version;
+    if (end == std::string::npos
+    || !json::parse(std::string_view(content).substr(0, end), value, error)
+    || !(version = value.get("cache"))
+    || !version->is(json::Type::NUMBER)) {
+        output_fail("'{}' is not an rsgain cache", path.string());
+        return false;
+    }
+    if (version->number != CACHE_VERSION) {
+        output_fail("Cache '{}' was written by an incompatible version of rsgain", path.string());
+        return false;
+    }
+
+    // Lines that can't be read, e.g. cut off by a crash, are ignored. A
+    // loudness of null is the -inf of a silent track
+    size_t damaged = 0;
+    for (size_t start = end + 1; (end = content.find('\n', start)) != std::string::npos; start = end + 1) {
+        const json::Value *key, *loudness, *peak;
+        if (!json::parse(std::string_view(content).substr(start, end - start), value, error)
+        || !(key = value.get("key")) || !key->is(json::Type::STRING)
+        || !(loudness = value.get("loudness")) || !(loudness->is(json::Type::NUMBER) || loudness->is(json::Type::NUL))
+        || !(peak = value.get("peak")) || !peak->is(json::Type::NUMBER)) {
+            damaged++;
+            continue;
+        }
+        entries[key->string] = {loudness->is(json::Type::NUMBER) ? loudness->number : -HUGE_VAL, peak->number};
+    }
+    if (damaged)
+        output_warn("Ignored {} damaged {} in cache '{}'", damaged, damaged > 1 ? "entries" : "entry", path.string());
+
+    // Start a new line after a line that was cut off
+    if (content.back() != '\n') {
+        if (!(file = fopen(path.string().c_str(), "ab")) || fputc('\n', file) == EOF || fclose(file)) {
+            output_fail("Could not write cache file '{}'", path.string());
+            return false;
+        }
+    }
+    return true;
+}
+
+bool LoudnessCache::find(const std::string &key, Entry &entry)
+{
+    std::scoped_lock lock(mutex);
+    auto it = entries.find(key);
+    if (it == entries.end())
+        return false;
+    entry = it->second;
+    return true;
+}
+
+void LoudnessCache::insert(const std::string &key, const Entry &entry)
+{
+    std::scoped_lock lock(mutex);
+    if (!entries.emplace(key, entry).second)
+        return;
+    pending += rsgain::format("{{\"key\":{},\"loudness\":{},\"peak\":{}}}\n",
+        json::escape(key),
+        json::number(entry.loudness),
+        json::number(entry.peak)
+    );
+}
+
+// Write the entries that were inserted since the last flush. The cache isn't
+// synced to disk, an entry that is lost in a crash is only scanned again
+void LoudnessCache::flush()
+{
+    std::scoped_lock lock(mutex);
+    if (!stream || pending.empty())
+        return;
+    failed |= fwrite(pending.data(), 1, pending.size(), stream) != pending.size() || fflush(stream);
+    pending.clear();
+}
+
+bool LoudnessCache::close()
+{
+    if (!stream)
+        return true;
+    flush();
+    fclose(stream);
+    stream = nullptr;
+    if (failed) {
+        output_error("Failed to write cache file '{}'", path.string());
+        return false;
+    }
+    return true;
+}
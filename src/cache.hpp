@@ -0,0 +1,44 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <filesystem>
+#include <unordered_map>
+#include <stdio.h>
+
+#define CACHE_VERSION 1
+
+// Loudness results of previous runs, keyed by the MD5 of the audio that FLAC,
+// WavPack and Monkey's Audio store in their headers. Unlike the path and mtime,
+// the checksum doesn't change when a file is retagged, renamed or moved, so
+// those files don't need to be decoded again. New results are appended to
+// the file after each job
+class LoudnessCache {
+    public:
+        struct Entry {
+            double loudness;
+            double peak;
+        };
+
+        ~LoudnessCache();
+        bool open(const std::filesystem::path &path);
+        bool find(const std::string &key, Entry &entry);
+        void insert(const std::string &key, const Entry &entry);
+        void flush();
+        void add_hits(size_t n) { nb_hits.fetch_add(n, std::memory_order_relaxed); }
+        bool close();
+        size_t size() const { return entries.size(); }
+        size_t hits() const { return nb_hits.load(std::memory_order_relaxed); }
+
+    private:
+        std::filesystem::path path;
+        std::unordered_map<std::string, Entry> entries;
+        std::FILE *stream = nullptr;
+        std::string pending;
+        std::mutex mutex;
+        std::atomic<size_t> nb_hits = 0;
+        bool failed = false;
+
+        bool load();
+};
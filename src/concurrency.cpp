@@ -0,0 +1,276 @@
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <thread>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "concurrency.hpp"
+#include "output.hpp"
+
+#define AUTO_INTERVAL  5     // Seconds between two adjustments
+#define AUTO_TOLERANCE 0.05  // Relative change in throughput that is considered noise
+#define AUTO_IO_BOUND  0.75  // Per-worker CPU utilization below which the workers are waiting on I/O
+#define AUTO_HOLD      3     // Number of intervals to wait after a change was reverted
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+#ifdef __linux__
+static std::string read_first_line(const std::filesystem::path &path)
+{
+    std::ifstream file(path);
+    std::string line;
+    if (file)
+        std::getline(file, line);
+    return line;
+}
+
+// Paths of this process in the cgroup hierarchies, keyed by controller.
+// The unified (v2) hierarchy has an empty key
+static std::vector<std::pair<std::string, std::string>> get_cgroups()
+{
+    std::vector<std::pair<std::string, std::string>> cgroups;
+    std::ifstream file("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t first = line.find(':');
+        size_t second = line.find(':', first + 1);
+        if (first == std::string::npos || second == std::string::npos)
+            continue;
+        cgroups.emplace_back(line.substr(first + 1, second - first - 1), line.substr(second + 1));
+    }
+    return cgroups;
+}
+
+// Looks for a limit file in the process's cgroup and all of its ancestors and returns
+// the lowest limit found. Inside a container, the cgroup path may refer to the host's
+// hierarchy, so the root of the mount is always checked as well
+template <typename T>
+static void find_cgroup_limit(const std::filesystem::path &mount, const std::string &cgroup, const char *name, T &&parse)
+{
+    std::filesystem::path path = std::filesystem::path(cgroup).relative_path();
+    while (true) {
+        std::string line = read_first_line(mount / path / name);
+        if (!line.empty())
+            parse(mount / path, line);
+        if (path.empty())
+            break;
+        path = path.parent_path();
+    }
+}
+
+static void read_cgroup_limits(ResourceLimits &limits)
+{
+    double cpu_quota = 0.0;
+    auto set_cpu_quota = [&](double quota) {
+        if (quota > 0.0 && (cpu_quota == 0.0 || quota < cpu_quota))
+            cpu_quota = quota;
+    };
+    auto set_memory = [&](uint64_t memory) {
+        // cgroup v1 reports "unlimited" as a huge page-aligned number
+        if (memory && memory < (1ULL << 60) && (!limits.memory || memory < limits.memory))
+            limits.memory = memory;
+    };
+
+    for (const auto &[controllers, cgroup] : get_cgroups()) {
+
+        // cgroup v2: "cpu.max" contains "$MAX $PERIOD", where $MAX may be "max"
+        if (controllers.empty()) {
+            find_cgroup_limit(CGROUP_ROOT, cgroup, "cpu.max", [&](const std::filesystem::path&, const std::string &line) {
+                size_t space = line.find(' ');
+                if (space != std::string::npos && !line.starts_with("max"))
+                    set_cpu_quota(strtod(line.c_str(), nullptr) / strtod(line.c_str() + space, nullptr));
+            });
+            find_cgroup_limit(CGROUP_ROOT, cgroup, "memory.max", [&](const std::filesystem::path&, const std::string &line) {
+                if (line != "max")
+                    set_memory(strtoull(line.c_str(), nullptr, 10));
+            });
+            continue;
+        }
+
+        // cgroup v1: separate hierarchies for each controller
+        for (const char *mount : {CGROUP_ROOT "/cpu,cpuacct", CGROUP_ROOT "/cpu"}) {
+            if (controllers.find("cpu") == std::string::npos || !std::filesystem::exists(mount))
+                continue;
+            find_cgroup_limit(mount, cgroup, "cpu.cfs_quota_us", [&](const std::filesystem::path &dir, const std::string &quota) {
+                long long q = strtoll(quota.c_str(), nullptr, 10);
+                if (q <= 0)
+                    return;
+                long long p = strtoll(read_first_line(dir / "cpu.cfs_period_us").c_str(), nullptr, 10);
+                if (p > 0)
+                    set_cpu_quota((double) q / (double) p);
+            });
+            break;
+        }
+        if (controllers.find("memory") != std::string::npos) {
+            find_cgroup_limit(CGROUP_ROOT "/memory", cgroup, "memory.limit_in_bytes", [&](const std::filesystem::path&, const std::string &line) {
+                set_memory(strtoull(line.c_str(), nullptr, 10));
+            });
+        }
+    }
+
+    // A fractional quota still allows a thread to run part of the time, so round up
+    if (cpu_quota > 0.0)
+        limits.cpus = std::min(limits.cpus, std::max(1u, (unsigned int) std::ceil(cpu_quota)));
+}
+#endif
+
+// Determine the CPUs and memory available to the process, taking into account
+// the CPU affinity mask (cpuset) and the cgroup v1/v2 CPU quota and memory limit
+const ResourceLimits& get_resource_limits()
+{
+    static const ResourceLimits limits = []() {
+        ResourceLimits limits = {
+            .cpus = std::max(1u, std::thread::hardware_concurrency()),
+            .memory = 0
+        };
+#ifdef __linux__
+        cpu_set_t set;
+        if (!sched_getaffinity(0, sizeof(set), &set) && CPU_COUNT(&set) > 0)
+            limits.cpus = std::min(limits.cpus, (unsigned int) CPU_COUNT(&set));
+        read_cgroup_limits(limits);
+#endif
+        return limits;
+    }();
+    return limits;
+}
+
+// Reduce a number of workers so that their combined memory use stays well below the memory limit.
+// Each worker may also have queued_per_worker scanned jobs waiting to be tagged
+size_t limit_workers(size_t nb_workers, size_t queued_per_worker)
+{
+    const ResourceLimits &limits = get_resource_limits();
+    if (!limits.memory)
+        return nb_workers;
+    uint64_t per_worker = WORKER_MEMORY_ESTIMATE + queued_per_worker * QUEUED_JOB_MEMORY_ESTIMATE;
+    size_t max_workers = std::max<size_t>(1, (size_t) (limits.memory / 4 * 3 / per_worker));
+    return std::min(nb_workers, max_workers);
+}
+
+// CPU time consumed by all threads of the process, in seconds
+double process_cpu_time()
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+        return 0.0;
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (double) (k.QuadPart + u.QuadPart) * 1e-7;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0.0;
+    return (double) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+        + (double) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+#endif
+}
+
+ConcurrencyController::ConcurrencyController(size_t initial, size_t max_workers, size_t nb_cpus)
+: nb_active(std::clamp<size_t>(initial, 1, max_workers)), max_workers(max_workers), nb_cpus(nb_cpus)
+{
+    start_time = last_time = Clock::now();
+    last_cpu = process_cpu_time();
+    history.push_back({0.0, nb_active, 0});
+}
+
+// Set the prefetch budget for the current number of active workers
+void ConcurrencyController::set_prefetch(uint64_t budget)
+{
+    prefetch_per_worker = budget / nb_active;
+    history.back().prefetch = prefetch();
+}
+
+// Returns true if the number of active workers was changed
+bool ConcurrencyController::update(uint64_t bytes)
+{
+    const auto now = Clock::now();
+    double elapsed = std::chrono::duration<double>(now - last_time).count();
+    if (elapsed < AUTO_INTERVAL || bytes == last_bytes)
+        return false;
+
+    double cpu = process_cpu_time();
+    double throughput = (double) (bytes - last_bytes) / elapsed;
+    double utilization = (cpu - last_cpu) / (elapsed * (double) nb_active);
+    last_time = now;
+    last_bytes = bytes;
+    last_cpu = cpu;
+
+    size_t step = std::max<size_t>(1, nb_active / 8);
+    size_t target = nb_active;
+
+    // Judge the change that was made at the end of the previous interval
+    if (previous) {
+        double change = last_throughput > 0.0 ? throughput / last_throughput - 1.0 : 0.0;
+
+        // Throughput went down, or adding workers didn't gain anything: go back
+        if (change < -AUTO_TOLERANCE || (direction > 0 && change <= AUTO_TOLERANCE)) {
+            target = previous;
+            direction = -direction;
+            hold = AUTO_HOLD;
+        }
+
+        // Keep moving in the same direction
+        else
+            target = direction > 0 ? nb_active + step : nb_active - std::min(step, nb_active - 1);
+    }
+    else if (hold)
+        hold--;
+
+    // Probe a new setting. Workers that spend most of their time waiting for I/O are a
+    // sign that more of them are needed to saturate the storage
+    else {
+        direction = (utilization < AUTO_IO_BOUND || nb_active < nb_cpus) ? 1 : -1;
+        target = direction > 0 ? nb_active + step : nb_active - std::min(step, nb_active - 1);
+    }
+
+    last_throughput = throughput;
+    target = std::clamp<size_t>(target, 1, max_workers);
+    if (target == nb_active || hold == AUTO_HOLD) {
+        previous = 0;
+        if (target == nb_active)
+            return false;
+    }
+    else
+        previous = nb_active;
+    set_active(target, now);
+    return true;
+}
+
+void ConcurrencyController::set_active(size_t n, Clock::time_point now)
+{
+    nb_active = n;
+    history.push_back({std::chrono::duration<double>(now - start_time).count(), n, prefetch()});
+}
+
+// Chosen concurrency over time, e.g. "8 (0:00) → 10 (0:05) → 9 (0:10)", with
+// the prefetch budget if there is one, e.g. "8, 512 MiB (0:00) → 10, 640 MiB (0:05)"
+std::string ConcurrencyController::summary() const
+{
+    std::string s;
+    for (const Sample &sample : history) {
+        if (!s.empty())
+            s += " → ";
+        long seconds = std::lround(sample.time);
+        s += rsgain::format("{}{} ({}:{:02})",
+            sample.nb_active,
+            prefetch_per_worker ? rsgain::format(", {:L} MiB", sample.prefetch >> 20) : "",
+            seconds / 60,
+            seconds % 60
+        );
+    }
+    return s;
+}
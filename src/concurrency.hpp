@@ -0,0 +1,70 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+
+// Upper bound of -m auto, as a multiple of the available CPUs. Workers that
+// are blocked on slow storage don't use a core, so it can pay off to run more
+// of them than there are CPUs
+#define AUTO_MAX_FACTOR 4
+
+// Rough peak memory use of one worker (demuxer and decoder buffers, loudness
+// state of an album), used to stay below a container's memory limit
+#define WORKER_MEMORY_ESTIMATE (96ULL << 20)
+
+// Rough memory use of a scanned job that is waiting to be tagged (track results
+// and loudness states of an album)
+#define QUEUED_JOB_MEMORY_ESTIMATE (16ULL << 20)
+
+// Resources that the process may actually use. In a container, these can be
+// far lower than what the host reports
+struct ResourceLimits {
+    unsigned int cpus;
+    uint64_t memory; // 0 if there is no limit
+};
+
+const ResourceLimits& get_resource_limits();
+size_t limit_workers(size_t nb_workers, size_t queued_per_worker = 0);
+double process_cpu_time();
+
+// Hill-climbing controller behind -m auto. It is fed the number of bytes the
+// workers have read so far and periodically grows or shrinks the number of
+// active workers towards the point of maximum throughput. With prefetching,
+// the prefetch budget is scaled with the number of active workers, since more
+// workers consume the prefetched files faster
+class ConcurrencyController {
+    public:
+        ConcurrencyController(size_t initial, size_t max_workers, size_t nb_cpus);
+        bool update(uint64_t bytes);
+        size_t active() const { return nb_active; }
+        void set_prefetch(uint64_t budget);
+        uint64_t prefetch() const { return prefetch_per_worker * nb_active; }
+        std::string summary() const;
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        size_t nb_active;
+        size_t max_workers;
+        size_t nb_cpus;
+        Clock::time_point start_time;
+        Clock::time_point last_time;
+        uint64_t last_bytes = 0;
+        double last_cpu;
+        double last_throughput = 0.0;
+        size_t previous = 0;
+        int direction = 1;
+        int hold = 0;
+        uint64_t prefetch_per_worker = 0;
+        struct Sample {
+            double time;
+            size_t nb_active;
+            uint64_t prefetch;
+        };
+        std::vector<Sample> history;
+
+        void set_active(size_t n, Clock::time_point now);
+};
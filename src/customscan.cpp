@@ -0,0 +1,138 @@
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <string>
+#include <utility>
+#include <algorithm>
+
+#include "rsgain.hpp"
+#include "customscan.hpp"
+#include "output.hpp"
+
+CustomScanner::CustomScanner(size_t nb_threads, bool split_tracks) : nb_threads(nb_threads), split_tracks(split_tracks)
+{
+    if (nb_threads > 1) {
+        pool = std::make_unique<ThreadPool>(nb_threads);
+        max_entries = nb_threads * CUSTOM_JOBS_PER_THREAD;
+        tagger = std::make_unique<std::thread>(&CustomScanner::tag, this);
+    }
+}
+
+CustomScanner::~CustomScanner()
+{
+    finish();
+}
+
+// Blocks while too many jobs are waiting to be tagged, so that a long
+// list doesn't keep the loudness state of every album in memory
+void CustomScanner::submit(std::unique_ptr<ScanJob> job)
+{
+    if (!pool) {
+        job->scan();
+        if (job->error)
+            nb_errors++;
+        return;
+    }
+
+    auto entry = std::make_shared<Entry>();
+    entry->job = std::move(job);
+    {
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [this]{ return entries.size() < max_entries; });
+        entries.push_back(entry);
+    }
+    pool->submit([this, entry]{ prepare(entry); });
+}
+
+// Wait until all jobs have been tagged. Returns the number of jobs that failed
+size_t CustomScanner::finish()
+{
+    if (tagger) {
+        {
+            std::scoped_lock lock(mutex);
+            quit = true;
+        }
+        cv.notify_all();
+        tagger->join();
+        tagger.reset();
+        pool.reset();
+    }
+    return nb_errors;
+}
+
+// Runs on the pool. Each track of the job is scanned as a separate task, and
+// the last one to finish calculates the album loudness
+void CustomScanner::prepare(std::shared_ptr<Entry> entry)
+{
+    ScanJob &job = *entry->job;
+    if (!job.filter_existing()) {
+        entry->scanned = false;
+        complete(*entry);
+        return;
+    }
+    size_t nb_tracks = job.nb_tracks();
+    if (!job.needs_scan() || !nb_tracks) {
+        complete(*entry);
+        return;
+    }
+
+    entry->results.resize(nb_tracks, ScanReturn::SUCCESS);
+    entry->remaining = nb_tracks;
+    size_t pending = nb_pending.fetch_add(nb_tracks) + nb_tracks;
+    if (split_tracks) {
+        job.max_segments = std::max<size_t>(nb_threads / pending, 1);
+        job.pool = pool.get();
+    }
+    for (size_t i = 0; i < nb_tracks; i++) {
+        pool->submit([this, entry, i]{
+            entry->results[i] = entry->job->scan_track(i, &ffmpeg_mutex);
+            nb_pending.fetch_sub(1);
+            if (entry->remaining.fetch_sub(1) == 1) {
+                entry->scanned = entry->job->finish_scan(entry->results);
+                complete(*entry);
+            }
+        });
+    }
+}
+
+void CustomScanner::complete(Entry &entry)
+{
+    {
+        std::scoped_lock lock(mutex);
+        entry.done = true;
+    }
+    cv.notify_all();
+}
+
+// Tags the jobs in the order they were submitted, as soon as each one is done
+void CustomScanner::tag()
+{
+    std::unique_lock lock(mutex);
+    while (true) {
+        cv.wait(lock, [this]{ return (!entries.empty() && entries.front()->done) || (quit && entries.empty()); });
+        if (entries.empty())
+            return;
+        std::shared_ptr<Entry> entry = std::move(entries.front());
+        entries.pop_front();
+        lock.unlock();
+        cv.notify_all();
+
+        ScanJob &job = *entry->job;
+        if (entry->scanned)
+            job.tag_tracks(true);
+        if (job.error) {
+            report(job);
+            nb_errors++;
+        }
+        lock.lock();
+    }
+}
+
+// Errors aren't printed while the tracks are scanned in parallel, so
+// name the file that failed once the job's turn has come
+void CustomScanner::report(const ScanJob &job)
+{
+    if (!job.error_file.empty())
+        output_error("Could not scan '{}'", job.error_file.string());
+}
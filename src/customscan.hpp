@@ -0,0 +1,54 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include "scan.hpp"
+#include "threadpool.hpp"
+
+// Maximum number of jobs that have been submitted but not yet tagged, per thread
+#define CUSTOM_JOBS_PER_THREAD 4
+
+// Runs the jobs of Custom Mode. With more than one thread, the tracks of all
+// submitted jobs are decoded in parallel, while the jobs are tagged and their
+// results printed on a separate thread in the order they were submitted.
+// With split_tracks, long tracks are split into segments that are scanned in
+// parallel when there are fewer tracks than threads
+class CustomScanner {
+    public:
+        CustomScanner(size_t nb_threads, bool split_tracks = false);
+        ~CustomScanner();
+        void submit(std::unique_ptr<ScanJob> job);
+        size_t finish();
+
+    private:
+        struct Entry {
+            std::unique_ptr<ScanJob> job;
+            std::vector<ScanReturn> results;
+            std::atomic<size_t> remaining = 0;
+            bool scanned = true;
+            bool done = false;
+        };
+
+        std::unique_ptr<ThreadPool> pool;
+        std::unique_ptr<std::thread> tagger;
+        std::mutex ffmpeg_mutex;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::shared_ptr<Entry>> entries;
+        size_t max_entries = 0;
+        size_t nb_threads;
+        bool split_tracks;
+        std::atomic<size_t> nb_pending = 0; // Tracks that have been submitted to the pool but not scanned
+        size_t nb_errors = 0;
+        bool quit = false;
+
+        void prepare(std::shared_ptr<Entry> entry);
+        void complete(Entry &entry);
+        void tag();
+        void report(const ScanJob &job);
+};
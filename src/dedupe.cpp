@@ -0,0 +1,208 @@
+#include <map>
+#include <list>
+#include <mutex>
+#include <tuple>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <filesystem>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+#include "dedupe.hpp"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+bool get_file_id([[maybe_unused]] const std::filesystem::path &path, uint64_t &device, uint64_t &inode)
+{
+#ifdef _WIN32
+    device = inode = 0;
+    return false;
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st))
+        return false;
+    device = (uint64_t) st.st_dev;
+    inode = (uint64_t) st.st_ino;
+    return true;
+#endif
+}
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// The input is read as little-endian on every platform
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+static inline uint64_t read32(const uint8_t *p)
+{
+    return (uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16 | (uint64_t) p[3] << 24;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    return rotl(acc, 31) * PRIME1;
+}
+
+static inline uint64_t merge_round(uint64_t acc, uint64_t value)
+{
+    acc ^= xxh_round(0, value);
+    return acc * PRIME1 + PRIME4;
+}
+
+XXH64::XXH64(uint64_t seed) : seed(seed)
+{
+    acc[0] = seed + PRIME1 + PRIME2;
+    acc[1] = seed + PRIME2;
+    acc[2] = seed;
+    acc[3] = seed - PRIME1;
+}
+
+void XXH64::update(const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t*) data;
+    total += size;
+    if (buffered) {
+        size_t n = std::min(size, sizeof(buffer) - buffered);
+        memcpy(buffer + buffered, p, n);
+        buffered += n;
+        p += n;
+        size -= n;
+        if (buffered < sizeof(buffer))
+            return;
+        for (int i = 0; i < 4; i++)
+            acc[i] = xxh_round(acc[i], read64(buffer + 8 * i));
+        buffered = 0;
+    }
+    for (; size >= 32; p += 32, size -= 32) {
+        for (int i = 0; i < 4; i++)
+            acc[i] = xxh_round(acc[i], read64(p + 8 * i));
+    }
+    memcpy(buffer, p, size);
+    buffered = size;
+}
+
+uint64_t XXH64::digest() const
+{
+    uint64_t h;
+    if (total >= 32) {
+        h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = merge_round(h, acc[i]);
+    }
+    else
+        h = seed + PRIME5;
+    h += total;
+
+    const uint8_t *p = buffer;
+    size_t size = buffered;
+    for (; size >= 8; p += 8, size -= 8)
+        h = rotl(h ^ xxh_round(0, read64(p)), 27) * PRIME1 + PRIME4;
+    if (size >= 4) {
+        h = rotl(h ^ (read32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+        p += 4;
+        size -= 4;
+    }
+    for (; size; p++, size--)
+        h = rotl(h ^ (*p * PRIME5), 11) * PRIME1;
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+void DedupeCache::hit(std::list<Item>::iterator item, Entry &entry)
+{
+    items.splice(items.begin(), items, item);
+    entry = item->entry;
+    nb_hits.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Look for another name of a file that has been decoded with the same peak mode
+bool DedupeCache::find_file(const std::filesystem::path &path, int mode, Entry &entry)
+{
+    uint64_t device, inode;
+    if (!get_file_id(path, device, inode))
+        return false;
+    std::scoped_lock lock(mutex);
+    auto it = files.find({device, inode, mode});
+    if (it == files.end())
+        return false;
+    hit(it->second, entry);
+    return true;
+}
+
+// Whether a file with the same stream parameters has been decoded before
+bool DedupeCache::is_candidate(uint64_t fingerprint)
+{
+    std::scoped_lock lock(mutex);
+    return fingerprints.contains(fingerprint);
+}
+
+bool DedupeCache::find_content(uint64_t fingerprint, uint64_t hash, Entry &entry)
+{
+    std::scoped_lock lock(mutex);
+    auto it = contents.find({fingerprint, hash});
+    if (it == contents.end())
+        return false;
+    hit(it->second, entry);
+    return true;
+}
+
+// Add the result of a decoded file. A fingerprint of 0 means that the file
+// can only be found by its inode
+void DedupeCache::insert(const std::filesystem::path &path, int mode, uint64_t fingerprint, uint64_t hash, const Entry &entry)
+{
+    Item item = {
+        .entry = entry,
+        .file = {},
+        .content = {fingerprint, hash},
+        .has_file = false,
+        .has_content = fingerprint != 0
+    };
+    uint64_t device, inode;
+    if (get_file_id(path, device, inode)) {
+        item.file = {device, inode, mode};
+        item.has_file = true;
+    }
+
+    std::scoped_lock lock(mutex);
+    if (fingerprint)
+        fingerprints.insert(fingerprint);
+
+    // Another thread may have decoded a copy at the same time
+    if ((item.has_file && files.contains(item.file)) || (item.has_content && contents.contains(item.content)))
+        return;
+    items.push_front(std::move(item));
+    if (items.front().has_file)
+        files[items.front().file] = items.begin();
+    if (items.front().has_content)
+        contents[items.front().content] = items.begin();
+
+    if (items.size() > DEDUPE_CACHE_SIZE) {
+        const Item &last = items.back();
+        if (last.has_file)
+            files.erase(last.file);
+        if (last.has_content)
+            contents.erase(last.content);
+        items.pop_back();
+    }
+}
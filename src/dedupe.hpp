@@ -0,0 +1,74 @@
+#pragma once
+
+#include <map>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <filesystem>
+#include <unordered_set>
+#include <stdint.h>
+#include <stddef.h>
+#include <ebur128.h>
+
+#define DEDUPE_CACHE_SIZE 256 // Loudness states kept for reuse, each one can take several hundred KiB
+
+bool get_file_id(const std::filesystem::path &path, uint64_t &device, uint64_t &inode);
+
+// Streaming implementation of the 64 bit xxHash
+class XXH64 {
+    public:
+        XXH64(uint64_t seed = 0);
+        void update(const void *data, size_t size);
+        uint64_t digest() const;
+
+    private:
+        uint64_t acc[4];
+        uint8_t buffer[32];
+        size_t buffered = 0;
+        uint64_t total = 0;
+        uint64_t seed;
+};
+
+// Results of recently decoded files, so that other copies of the same audio
+// don't need to be decoded. A copy is found either by its device and inode
+// number for a hardlink, or by the hash of its audio packets, which doesn't
+// include the tags. Since hashing takes a pass over the file, it's only done
+// when the stream parameters of a file match one that has been decoded before
+class DedupeCache {
+    public:
+        struct Entry {
+            std::shared_ptr<ebur128_state> ebur128;
+            int codec_id;
+            std::string container;
+        };
+
+        bool find_file(const std::filesystem::path &path, int mode, Entry &entry);
+        bool is_candidate(uint64_t fingerprint);
+        bool find_content(uint64_t fingerprint, uint64_t hash, Entry &entry);
+        void insert(const std::filesystem::path &path, int mode, uint64_t fingerprint, uint64_t hash, const Entry &entry);
+        size_t hits() const { return nb_hits.load(std::memory_order_relaxed); }
+
+    private:
+        using FileKey = std::tuple<uint64_t, uint64_t, int>; // Device, inode, peak mode
+        using ContentKey = std::pair<uint64_t, uint64_t>;    // Fingerprint, packet hash
+        struct Item {
+            Entry entry;
+            FileKey file;
+            ContentKey content;
+            bool has_file;
+            bool has_content;
+        };
+
+        std::mutex mutex;
+        std::list<Item> items; // Most recently used first
+        std::map<FileKey, std::list<Item>::iterator> files;
+        std::map<ContentKey, std::list<Item>::iterator> contents;
+        std::unordered_set<uint64_t> fingerprints; // Of all decoded files, for the whole run
+        std::atomic<size_t> nb_hits = 0;
+
+        void hit(std::list<Item>::iterator item, Entry &entry);
+};
@@ -10,6 +10,7 @@
 #include <condition_variable>
 #include <initializer_list>
 #include <unordered_map>
+#include <unordered_set>
 #include <math.h>
 #include <string.h>
 #include <stdio.h>
@@ -25,6 +26,10 @@
 #include "easymode.hpp"
 #include "output.hpp"
 #include "scan.hpp"
+#include "concurrency.hpp"
+#include "traverse.hpp"
+#include "sink.hpp"
+#include "progress.hpp"
 
 #define MAX_THREAD_SLEEP 30
 #define HELP_STATS(title, format, ...) rsgain::print(COLOR_YELLOW "{:<18} " COLOR_OFF format "\n", title ":" __VA_OPT__(,) __VA_ARGS__)
@@ -35,7 +40,6 @@ extern "C" {
 }
 
 static inline void help_easy();
-bool multithread = false;
 
 static Config configs[] = {
 
@@ -409,8 +413,10 @@ void easy_mode(int argc, char *argv[])
 {
     int rc, i;
     char *preset = nullptr;
-    const char *short_opts = "+hqSl:m:p:O::";
+    const char *short_opts = "+hqSDdRl:m:Q:p:O::F:M:J:C:P:";
     unsigned int threads = 1;
+    OutputType format = OutputType::NONE;
+    EasyOptions options;
     opterr = 0;
 
     static struct option long_opts[] = {
@@ -419,8 +425,17 @@ void easy_mode(int argc, char *argv[])
 
         { "skip-existing", no_argument,       nullptr, 'S' },
         { "multithread",   required_argument, nullptr, 'm' },
+        { "disk-order",    no_argument,       nullptr, 'D' },
+        { "device-limit",  required_argument, nullptr, 'Q' },
         { "preset",        required_argument, nullptr, 'p' },
         { "output",        optional_argument, nullptr, 'O' },
+        { "output-format", required_argument, nullptr, 'F' },
+        { "metrics",       required_argument, nullptr, 'M' },
+        { "journal",       required_argument, nullptr, 'J' },
+        { "dedupe",        no_argument,       nullptr, 'd' },
+        { "cache",         required_argument, nullptr, 'C' },
+        { "prefetch",      required_argument, nullptr, 'P' },
+        { "drop-cache",    no_argument,       nullptr, 'R' },
         { 0, 0, 0, 0 }
     };
     while ((rc = getopt_long(argc, argv, short_opts, long_opts, &i)) != -1) {
@@ -441,12 +456,15 @@ void easy_mode(int argc, char *argv[])
             
             case 'm':
                 {
-                    unsigned int max_threads = std::thread::hardware_concurrency();
-                    if (!max_threads)
-                        max_threads = 1;
+                    unsigned int max_threads = get_resource_limits().cpus;
                     if (MATCH(optarg, "MAX") || MATCH(optarg, "max")) {
                         threads = max_threads;
                     }
+                    else if (MATCH(optarg, "AUTO") || MATCH(optarg, "auto")) {
+                        threads = 0;
+                        multithread = true;
+                        break;
+                    }
                     else {
                         threads = (unsigned int) (strtoul(optarg, nullptr, 10));
                         if (threads < 1) {
@@ -461,6 +479,24 @@ void easy_mode(int argc, char *argv[])
                     multithread = (threads > 1);
                 }
                 break;
+
+            case 'D':
+                options.disk_order = true;
+                break;
+
+            case 'Q':
+                {
+                    // PATH=N, split at the last '=' since the path may contain one
+                    const char *separator = strrchr(optarg, '=');
+                    char *end = nullptr;
+                    unsigned long limit = separator ? strtoul(separator + 1, &end, 10) : 0;
+                    if (!separator || separator == optarg || !limit || *end) {
+                        output_fail("Invalid device limit '{}', expected PATH=N", optarg);
+                        quit(EXIT_FAILURE);
+                    }
+                    options.device_limits.emplace_back(std::string(optarg, (size_t) (separator - optarg)), (size_t) limit);
+                }
+                break;
             
             case 'p':
                 if (preset == nullptr)
@@ -479,6 +515,49 @@ void easy_mode(int argc, char *argv[])
                     config.tab_output = OutputType::FILE;
                 break;
 
+            case 'F':
+                if (!parse_output_format(optarg, format))
+                    quit(EXIT_FAILURE);
+                break;
+
+            case 'M':
+                options.metrics_file = optarg;
+                break;
+
+            case 'J':
+                options.journal_file = optarg;
+                break;
+
+            case 'd':
+                options.dedupe = true;
+                break;
+
+            case 'C':
+                options.cache_file = optarg;
+                break;
+
+            case 'P':
+                {
+                    char *end = nullptr;
+                    unsigned long long mib = strtoull(optarg, &end, 10);
+                    if (!mib || *end) {
+                        output_fail("Invalid prefetch size '{}', expected a number of MiB", optarg);
+                        quit(EXIT_FAILURE);
+                    }
+                    options.prefetch_budget = (uint64_t) mib << 20;
+#ifdef _WIN32
+                    output_warn("Prefetching is not supported on Windows");
+#endif
+                }
+                break;
+
+            case 'R':
+                options.drop_cache = true;
+#ifdef _WIN32
+                output_warn("Dropping files from the page cache is not supported on Windows");
+#endif
+                break;
+
             case '?':
                 if (optopt)
                     output_fail("Unrecognized option '{:c}'", optopt);
@@ -493,7 +572,19 @@ void easy_mode(int argc, char *argv[])
         quit(EXIT_FAILURE);
     }
 
-    scan_easy(argv[optind], preset ? preset : std::filesystem::path(), threads);
+    // Instead of a CSV file per directory, the records of all directories
+    // are written to one file in the scanned directory
+    if (format != OutputType::NONE) {
+        for (Config &config : configs)
+            config.tab_output = format;
+        bool ndjson = format == OutputType::NDJSON;
+        std::filesystem::path output_file = std::filesystem::path(argv[optind]) / (ndjson ? "replaygain.ndjson" : "replaygain.rgc");
+        if (std::filesystem::is_directory(argv[optind]) && !result_sink.open(output_file, ndjson ? SinkFormat::NDJSON : SinkFormat::COLUMNAR))
+            quit(EXIT_FAILURE);
+    }
+
+    options.nb_threads = threads;
+    scan_easy(argv[optind], preset ? preset : std::filesystem::path(), options);
 }
 
 static bool convert_bool(const char *value, bool &setting)
@@ -765,6 +856,28 @@ static void load_preset(const std::filesystem::path &preset)
     fclose(file);
 }
 
+ScanJob* ScanJob::factory(Directory &directory)
+{
+    std::unordered_set<FileType> extensions;
+    FileType file_type;
+    std::vector<Track> tracks;
+
+    for (const AudioFile &file : directory.files) {
+        if (!(file.type == FileType::M4A && get_config(file.type).skip_mp4 && file.path.extension().string() == ".mp4")
+        && !(file.path.filename().string().starts_with("._"))) {
+            tracks.emplace_back(file.path, file.type).size = file.size;
+            extensions.insert(file.type);
+        }
+    }
+    if (tracks.empty())
+        return nullptr;
+    file_type = extensions.size() > 1 ? FileType::DEFAULT : *extensions.begin();
+    const Config &config = get_config(file_type);
+    if (config.tag_mode == 'n')
+        return nullptr;
+    return new ScanJob(directory.path, tracks, config, file_type);
+}
+
 bool WorkerThread::place_job(std::unique_ptr<ScanJob> &job)
 {
     std::unique_lock lock(mutex, std::try_to_lock);
@@ -779,27 +892,38 @@ bool WorkerThread::place_job(std::unique_ptr<ScanJob> &job)
 
 void WorkerThread::work()
 {
+    using Clock = std::chrono::steady_clock;
     std::unique_lock lock(mutex);
     {
         std::scoped_lock main_lock(main_mutex);
         main_cv.notify_all();
     }
 
+    Clock::time_point idle_since = Clock::now();
     while (!quit) {
         if (job_available) {
-            job->scan(&ffmpeg_mutex);
-            
-            // Update statistics
-            {
-                std::scoped_lock main_lock(main_mutex);
-                job->update_data(data);
+            Clock::time_point start = Clock::now();
+            bool write_tags = job->analyze(&ffmpeg_mutex, &counters);
+            if (metrics) {
+                Clock::time_point end = Clock::now();
+                metrics->add_worker_time(std::chrono::duration<double>(end - start).count(), std::chrono::duration<double>(start - idle_since).count());
+                idle_since = end;
             }
+
+            // The tags are written, the statistics updated and the job's slot on its
+            // device released by the tag writer
+            tag_writer.push(std::move(job), write_tags, start);
             job_available = false;
             main_cv.notify_all();
         }
                                                                                                                                                                                                                                                                                                                                                                         
         // Wait until we get a new job from the main thread
         cv.wait_for(lock, std::chrono::seconds(MAX_THREAD_SLEEP));
+        if (metrics) {
+            Clock::time_point now = Clock::now();
+            metrics->add_worker_time(0.0, std::chrono::duration<double>(now - idle_since).count());
+            idle_since = now;
+        }
     }
 }
 
@@ -817,9 +941,120 @@ bool WorkerThread::wait()
     return true;
 }
 
-void scan_easy(const std::filesystem::path &path, const std::filesystem::path &preset, size_t nb_threads)
+// Blocks while the queue is full
+void TagWriter::push(std::unique_ptr<ScanJob> job, bool write_tags, Clock::time_point start)
+{
+    {
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [this]{ return queued < max_queue; });
+        queued++;
+    }
+    pool.submit([this, job = std::shared_ptr<ScanJob>(std::move(job)), write_tags, start]{
+        if (write_tags)
+            job->tag_tracks(false);
+        done(*job, std::chrono::duration<double>(Clock::now() - start).count());
+        {
+            std::scoped_lock lock(mutex);
+            queued--;
+        }
+        cv.notify_one();
+    });
+}
+
+void JobQueue::push(std::unique_ptr<ScanJob> job)
+{
+    // Jobs on a device that can't be identified all share one unlimited queue
+    uint64_t id = 0;
+    get_device_id(job->path, id);
+    auto [it, inserted] = index.try_emplace(id, devices.size());
+    if (inserted) {
+        Device &device = devices.emplace_back();
+        device.info = id ? get_device_info(id, job->path) : DeviceInfo{0, DeviceType::SOLID_STATE, 0, "unknown"};
+    }
+    Device &device = devices[it->second];
+    job->device = it->second;
+    device.jobs.push_back(std::move(job));
+    device.total++;
+    nb_jobs++;
+}
+
+// Override the limit of the device that holds path. Returns false if the path is invalid,
+// or if none of the queued jobs are on its device
+bool JobQueue::set_limit(const std::filesystem::path &path, size_t limit)
+{
+    uint64_t id;
+    if (!get_device_id(path, id))
+        return false;
+    auto it = index.find(id);
+    if (it == index.end())
+        return false;
+    devices[it->second].info.limit = limit;
+    return true;
+}
+
+// The next job that can be started without exceeding the limit of its device,
+// or nullptr if all devices with pending jobs are busy
+std::unique_ptr<ScanJob>* JobQueue::front()
+{
+    for (size_t i = 0; i < devices.size(); i++) {
+        size_t d = (next + i) % devices.size();
+        Device &device = devices[d];
+        if (!device.jobs.empty() && (!device.info.limit || device.in_flight < device.info.limit)) {
+            selected = d;
+            return &device.jobs.front();
+        }
+    }
+    return nullptr;
+}
+
+// Remove the job returned by front() after it has been handed to a worker
+void JobQueue::pop()
+{
+    Device &device = devices[selected];
+    device.jobs.pop_front();
+    device.in_flight++;
+    nb_jobs--;
+    next = (selected + 1) % devices.size();
+}
+
+void JobQueue::finish(const ScanJob &job)
+{
+    devices[job.device].in_flight--;
+}
+
+// Up to n of the pending jobs, in about the order they will be started
+std::vector<const ScanJob*> JobQueue::peek(size_t n) const
+{
+    std::vector<const ScanJob*> upcoming;
+    for (size_t depth = 0; upcoming.size() < n; depth++) {
+        size_t found = upcoming.size();
+        for (size_t i = 0; i < devices.size() && upcoming.size() < n; i++) {
+            const Device &device = devices[(next + i) % devices.size()];
+            if (depth < device.jobs.size())
+                upcoming.push_back(device.jobs[depth].get());
+        }
+        if (upcoming.size() == found)
+            break;
+    }
+    return upcoming;
+}
+
+static const char* device_type_name(DeviceType type)
+{
+    switch (type) {
+        case DeviceType::ROTATIONAL:
+            return "rotational";
+        case DeviceType::REMOTE:
+            return "remote";
+        default:
+            return "solid state";
+    }
+}
+
+void scan_easy(const std::filesystem::path &path, const std::filesystem::path &preset, const EasyOptions &options)
 {
-    std::queue<std::unique_ptr<ScanJob>> jobs;
+    JobQueue jobs;
+    size_t nb_threads = options.nb_threads;
     ScanData data;
 
     // Verify directory exists and is valid
@@ -836,66 +1071,217 @@ void scan_easy(const std::filesystem::path &path, const std::filesystem::path &p
     if (!preset.empty())
         load_preset(preset);
 
+    ScanCounters counters;
+    std::unique_ptr<PageCache> page_cache;
+    if (options.drop_cache)
+        page_cache = std::make_unique<PageCache>();
+    std::unique_ptr<Metrics> metrics;
+    if (!options.metrics_file.empty()) {
+        metrics = std::make_unique<Metrics>(options.metrics_file, counters);
+        std::function<void(Metrics&)> sample;
+        if (page_cache)
+            sample = [&page_cache](Metrics &m){ m.set_page_cache(page_cache->held(), page_cache->resident()); };
+        if (!metrics->start(sample))
+            quit(EXIT_FAILURE);
+    }
+    std::unique_ptr<Journal> journal;
+    if (!options.journal_file.empty()) {
+        journal = std::make_unique<Journal>();
+        if (!journal->open(options.journal_file))
+            quit(EXIT_FAILURE);
+    }
+    std::unique_ptr<DedupeCache> dedupe;
+    if (options.dedupe)
+        dedupe = std::make_unique<DedupeCache>();
+    std::unique_ptr<LoudnessCache> cache;
+    if (!options.cache_file.empty()) {
+        cache = std::make_unique<LoudnessCache>();
+        if (!cache->open(options.cache_file))
+            quit(EXIT_FAILURE);
+    }
+
+    std::unique_ptr<Prefetcher> prefetcher;
+    if (options.prefetch_budget)
+        prefetcher = std::make_unique<Prefetcher>(options.prefetch_budget);
+
     // Record start time
     const auto start_time = std::chrono::system_clock::now();
 
-    // Generate queue of all directories in directory tree
+    // Generate list of all directories in directory tree
     output_ok("Building directory tree...");
-    std::queue<std::filesystem::path> directories;
-    directories.emplace(path);
-    for (const std::filesystem::directory_entry &entry : std::filesystem::recursive_directory_iterator(path)) {
-        if (entry.is_directory())
-            directories.emplace(entry.path());
-    }
+    std::vector<std::string> traverse_errors;
+    bool show_progress = !quiet && options.nb_threads != 1;
+    std::vector<Directory> directories = traverse(path, TRAVERSE_THREADS, options.disk_order, show_progress, traverse_errors);
+    for (const std::string &directory : traverse_errors)
+        output_warn("Could not read directory '{}'", directory);
     size_t nb_directories = directories.size();
     output_ok("Found {:L} {}...", nb_directories, nb_directories > 1 ? "directories" : "directory");
     output_ok("Scanning {} for files...", nb_directories > 1 ? "directories" : "directory");
     ScanJob *job;
-    while(!directories.empty()) {
-        if ((job = ScanJob::factory(directories.front())))
-            jobs.emplace(job);
-        directories.pop();
+    uint64_t total_files = 0;
+    uint64_t total_size = 0;
+    size_t nb_restored = 0;
+    for (Directory &directory : directories) {
+
+        // Directories that were completed before the run was interrupted
+        if (journal && journal->restore(directory.path, data)) {
+            nb_restored++;
+            continue;
+        }
+        if ((job = ScanJob::factory(directory))) {
+            total_files += job->nb_files;
+            total_size += job->total_size();
+            job->dedupe = dedupe.get();
+            job->cache = cache.get();
+            jobs.push(std::unique_ptr<ScanJob>(job));
+        }
     }
+    directories.clear();
     size_t nb_jobs = jobs.size();
+    if (nb_restored)
+        output_ok("Resuming from journal, {:L} {} already scanned", nb_restored, nb_restored > 1 ? "directories were" : "directory was");
+
+    // Apply the per-device limits from the command line
+    for (const auto &[device_path, limit] : options.device_limits) {
+        if (!jobs.set_limit(device_path, limit))
+            output_warn("Ignoring the device limit of '{}', it isn't on a device with directories to scan", device_path.string());
+    }
+    if (jobs.get_devices().size() > 1) {
+        for (const JobQueue::Device &device : jobs.get_devices()) {
+            output_ok("Device {} ({}): {:L} {}, {}",
+                device.info.name,
+                device.info.classified ? device_type_name(device.info.type) : "unknown type",
+                device.total,
+                device.total > 1 ? "directories" : "directory",
+                device.info.limit ? rsgain::format("up to {} at a time", device.info.limit) : "no limit"
+            );
+        }
+    }
+
+    // E.g. ZFS datasets, which have no single block device behind them
+    for (const JobQueue::Device &device : jobs.get_devices()) {
+        if (!device.info.classified && !device.info.limit) {
+            output_warn("Could not determine whether device {} is a hard drive, so it isn't limited. Use -Q PATH=N to limit it", device.info.name);
+        }
+    }
+
+    // With -m auto, the number of active workers is tuned while scanning
+    std::unique_ptr<ConcurrencyController> controller;
+    size_t max_threads = nb_threads;
+    if (!nb_threads) {
+        size_t nb_cpus = get_resource_limits().cpus;
+        max_threads = std::min(limit_workers(nb_cpus * AUTO_MAX_FACTOR, TAG_WRITER_QUEUE), nb_jobs);
+        nb_threads = std::min(nb_cpus, max_threads);
+        if (max_threads > 1) {
+            controller = std::make_unique<ConcurrencyController>(nb_threads, max_threads, nb_cpus);
+
+            // The budget of -P applies to the initial number of workers
+            if (prefetcher)
+                controller->set_prefetch(options.prefetch_budget);
+        }
+    }
+    else if (limit_workers(nb_threads, TAG_WRITER_QUEUE) < nb_threads) {
+        nb_threads = limit_workers(nb_threads, TAG_WRITER_QUEUE);
+        output_warn("Using {} threads to stay within the memory limit of {:L} MiB", nb_threads, get_resource_limits().memory >> 20);
+    }
     if (nb_threads > nb_jobs)
         nb_threads = nb_jobs;
 
+    // The tag writer queue is sized from the clamped count, so that capping the
+    // workers also caps the scanned jobs that wait in memory
+    if (!controller)
+        max_threads = nb_threads;
+
     // Mulithreaded scanning
-    if (nb_threads > 1) {
-        MTProgress progress(nb_jobs);
+    if (controller || nb_threads > 1) {
         std::vector<std::unique_ptr<WorkerThread>> threads;
         std::mutex ffmpeg_mutex;
         std::mutex mutex;
         std::condition_variable cv;
         std::unique_lock lock(mutex);
-
-        // Spawn worker threads
-        output_ok("Scanning with {} threads...", nb_threads);
-        for (size_t i = 0; i < nb_threads; i++) {
-            progress.update(jobs.front()->path.string());
+        ProgressMonitor progress(counters, total_files, total_size);
+
+        // Runs on the tag writer threads once a job is complete. The job's slot on its
+        // device is only released once its tags have been written, since TagLib may
+        // rewrite whole files on the same disk
+        std::mutex data_mutex;
+        TagWriter tag_writer(std::min((size_t) TAG_WRITER_THREADS, max_threads), TAG_WRITER_QUEUE * max_threads, [&](ScanJob &job, double seconds) {
+            if (journal)
+                journal->record(job);
+            {
+                std::scoped_lock data_lock(data_mutex);
+                job.update_data(data);
+            }
+            if (page_cache)
+                page_cache->release(job);
+            if (metrics)
+                metrics->record_job(job, seconds);
+            {
+                std::scoped_lock main_lock(mutex);
+                jobs.finish(job);
+            }
+            cv.notify_all();
+        });
+
+        // The job is popped before waiting, so that its device slot is taken before
+        // the worker can release it
+        auto spawn_thread = [&]() {
+            std::unique_ptr<ScanJob> *job = jobs.front();
+            if (!job)
+                return false;
+            const ScanJob *started = job->get();
+            if (page_cache)
+                page_cache->begin(*started);
             threads.emplace_back(std::make_unique<WorkerThread>(
-                jobs.front(),
+                *job,
                 mutex,
                 ffmpeg_mutex,
                 cv,
-                data
+                counters,
+                tag_writer,
+                metrics.get()
             ));
-            cv.wait_for(lock, std::chrono::milliseconds(200));
             jobs.pop();
+            if (prefetcher)
+                prefetcher->update(started, jobs.peek(PREFETCH_JOBS));
+            cv.wait_for(lock, std::chrono::milliseconds(200));
+            return true;
+        };
+
+        // Spawn worker threads
+        if (controller) {
+            output_ok("Scanning with {} threads (adjusting automatically up to {})...", nb_threads, max_threads);
+        }
+        else {
+            output_ok("Scanning with {} threads...", nb_threads);
         }
+        progress.start();
+        for (size_t i = 0; i < nb_threads && spawn_thread(); i++);
 
         // Feed jobs to workers
-        std::string current_job;
-        if (!jobs.empty())
-            current_job = jobs.front()->path.string();
         while (!jobs.empty()) {
             cv.wait_for(lock, std::chrono::milliseconds(200));
-            for (auto &thread : threads) {
-                if (thread->place_job(jobs.front())) {
+
+            // Workers beyond the active count are left idle until the controller raises it again.
+            // Threads that couldn't be spawned because of the device limits are spawned later
+            if (controller && controller->update(counters.bytes.load(std::memory_order_relaxed)) && prefetcher)
+                prefetcher->set_budget(controller->prefetch());
+            size_t nb_active = controller ? controller->active() : nb_threads;
+            while (threads.size() < nb_active && spawn_thread());
+            if (metrics)
+                metrics->set_queue(jobs.size(), std::min(nb_active, threads.size()));
+
+            std::unique_ptr<ScanJob> *job = jobs.front();
+            if (!job)
+                continue;
+            const ScanJob *started = job->get();
+            if (page_cache)
+                page_cache->begin(*started);
+            for (size_t i = 0; i < nb_active && i < threads.size(); i++) {
+                if (threads[i]->place_job(*job)) {
                     jobs.pop();
-                    progress.update(current_job);
-                    if (!jobs.empty())
-                        current_job = jobs.front()->path.string();
+                    if (prefetcher)
+                        prefetcher->update(started, jobs.peek(PREFETCH_JOBS));
                     break;
                 }
             }
@@ -906,23 +1292,54 @@ void scan_easy(const std::filesystem::path &path, const std::filesystem::path &p
         while (1) {
             for (auto thread = threads.begin(); thread != threads.end();)
                 thread = (*thread)->wait() ? threads.erase(thread) : thread + 1;
+            if (metrics)
+                metrics->set_queue(0, threads.size());
             if (threads.empty())
                 break;
             cv.wait_for(lock, std::chrono::milliseconds(200));
         }
-        rsgain::print("\33[2K\n");
+
+        // The tag writer takes the lock to release the device slots
+        lock.unlock();
+        tag_writer.wait();
+        progress.stop();
+        rsgain::print("\n");
     }
 
     // Single threaded scanning
     else {
-        while (!jobs.empty()) {
-            auto &job = jobs.front();
-            job->scan();
-            job->update_data(data);
+        std::unique_ptr<ScanJob> *next;
+        while ((next = jobs.front())) {
+            std::unique_ptr<ScanJob> job = std::move(*next);
             jobs.pop();
+            if (prefetcher)
+                prefetcher->update(job.get(), jobs.peek(PREFETCH_JOBS));
+            if (page_cache)
+                page_cache->begin(*job);
+            if (metrics)
+                metrics->set_queue(jobs.size(), 1);
+            auto job_start = std::chrono::steady_clock::now();
+            job->scan(nullptr, &counters);
+            if (page_cache)
+                page_cache->release(*job);
+            if (journal)
+                journal->record(*job);
+            job->update_data(data);
+            jobs.finish(*job);
+            if (metrics) {
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - job_start).count();
+                metrics->add_worker_time(seconds, 0.0);
+                metrics->record_job(*job, seconds);
+            }
         }
         rsgain::print("\n");
     }
+    if (metrics)
+        metrics->stop();
+    if (journal)
+        journal->close(true);
+    if (cache)
+        cache->close();
 
     // Output statistics at the end
     auto duration = std::chrono::floor<std::chrono::seconds>(std::chrono::system_clock::now() - start_time);
@@ -939,8 +1356,25 @@ void scan_easy(const std::filesystem::path &path, const std::filesystem::path &p
     rsgain::print(COLOR_GREEN "Scanning Complete" COLOR_OFF "\n");
     HELP_STATS("Time Elapsed", "{:%H:%M:%S}", duration);
     HELP_STATS("Files Scanned", "{:L}", data.files);
+    if (controller)
+        HELP_STATS("Concurrency", "{}", controller->summary());
     if (data.skipped)
         HELP_STATS("Files Skipped", "{:L}", data.skipped);
+    if (dedupe)
+        HELP_STATS("Duplicates", "{:L} files reused a result", dedupe->hits());
+    if (cache)
+        HELP_STATS("Cached", "{:L} files reused a result", cache->hits());
+    HELP_STATS("Read Wait", "{:.1f} s in av_read_frame()", (double) counters.read_wait_ns.load(std::memory_order_relaxed) / 1e9);
+    if (uint64_t nb_probes = counters.probes.load(std::memory_order_relaxed))
+        HELP_STATS("Probe Reads", "{:L} KiB per file, {:L} full probe{}",
+            counters.probe_bytes.load(std::memory_order_relaxed) / nb_probes >> 10,
+            counters.probe_fallbacks.load(std::memory_order_relaxed),
+            counters.probe_fallbacks.load(std::memory_order_relaxed) == 1 ? "" : "s"
+        );
+    if (prefetcher)
+        HELP_STATS("Prefetched", "{:L} MiB", prefetcher->total() >> 20);
+    if (page_cache)
+        HELP_STATS("Page Cache", "{:L} MiB dropped, at most {:L} MiB of files held", page_cache->resident() >> 20, page_cache->peak() >> 20);
     HELP_STATS("Clip Adjustments", "{:L} ({:.1f}% of files)", data.clipping_adjustments, 100.f * (float) data.clipping_adjustments / (float) data.files);
     HELP_STATS("Average Loudness", "{:.2f} LUFS", data.total_loudness / (double) data.files);
     HELP_STATS("Average Gain", "{:.2f} dB", data.total_gain / (double) data.files);
@@ -975,6 +1409,9 @@ static inline void help_easy() {
 
     CMD_HELP("--skip-existing", "-S", "Don't scan files with existing ReplayGain information");
     CMD_HELP("--multithread=n", "-m n", "Scan files with n parallel threads");
+    CMD_HELP("--multithread=auto", "-m auto", "Tune the number of threads to the storage while scanning");
+    CMD_HELP("--disk-order", "-D", "Scan files in the order they are stored on disk (for hard drives)");
+    CMD_HELP("--device-limit=p=n", "-Q p=n", "Scan at most n directories at a time from the device of path p");
     CMD_HELP("--preset=s", "-p s", "Load scan preset s");
 
     rsgain::print("\n");
@@ -982,6 +1419,14 @@ static inline void help_easy() {
     CMD_HELP("--output", "-O",  "Output tab-delimited scan data to CSV file per directory");
     CMD_HELP("--output=s", "-O s",  "Output with sep header (needed for Microsoft Excel compatibility)");
     CMD_HELP("--output=a", "-O a",  "Output with files sorted in alphanumeric order");
+    CMD_HELP("--output-format=f", "-F f",  "Output format: 'tsv' (default), 'ndjson' or 'columnar' (binary)");
+    CMD_CONT("ndjson and columnar write all results to one file in DIRECTORY");
+    CMD_HELP("--metrics=p", "-M p",  "Write statistics for Prometheus to file p while scanning");
+    CMD_HELP("--journal=p", "-J p",  "Record finished directories in file p to resume an interrupted scan");
+    CMD_HELP("--dedupe", "-d",  "Decode identical audio only once, e.g. copies with different tags");
+    CMD_HELP("--cache=p", "-C p",  "Keep the results of FLAC, WavPack and APE files in file p for later scans");
+    CMD_HELP("--prefetch=n", "-P n",  "Read up to n MiB of the next directories ahead of the threads");
+    CMD_HELP("--drop-cache", "-R",  "Drop the files from the page cache once they have been tagged");
 
     rsgain::print("\n");
 
@@ -6,13 +6,94 @@
 #include <mutex>
 #include <filesystem>
 #include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <deque>
+#include <queue>
+#include <unordered_map>
+#include <utility>
 #include "scan.hpp"
+#include "storage.hpp"
+#include "threadpool.hpp"
+#include "metrics.hpp"
+#include "journal.hpp"
+#include "dedupe.hpp"
+#include "cache.hpp"
+#include "prefetch.hpp"
+#include "pagecache.hpp"
+
+// Pending jobs, queued separately for each storage device. Each device has its own
+// limit of concurrently scanned jobs, and the devices are served in round-robin order
+// so that a slow hard drive doesn't hold up the jobs on an SSD
+class JobQueue {
+    public:
+        struct Device {
+            DeviceInfo info;
+            std::deque<std::unique_ptr<ScanJob>> jobs;
+            size_t in_flight = 0;
+            size_t total = 0;
+        };
+
+        void push(std::unique_ptr<ScanJob> job);
+        bool set_limit(const std::filesystem::path &path, size_t limit);
+        std::unique_ptr<ScanJob>* front();
+        void pop();
+        void finish(const ScanJob &job);
+        std::vector<const ScanJob*> peek(size_t n) const;
+        bool empty() const { return !nb_jobs; }
+        size_t size() const { return nb_jobs; }
+        const std::deque<Device>& get_devices() const { return devices; }
+
+    private:
+        std::deque<Device> devices;
+        std::unordered_map<uint64_t, size_t> index;
+        size_t next = 0;
+        size_t selected = 0;
+        size_t nb_jobs = 0;
+};
+
+struct EasyOptions {
+    size_t nb_threads = 1; // 0 for -m auto
+    bool disk_order = false;
+    std::vector<std::pair<std::filesystem::path, size_t>> device_limits;
+    std::filesystem::path metrics_file;
+    std::filesystem::path journal_file;
+    std::filesystem::path cache_file;
+    bool dedupe = false;
+    uint64_t prefetch_budget = 0; // Bytes
+    bool drop_cache = false;
+};
+
+#define TAG_WRITER_THREADS 2 // Threads that write the tags of a multithreaded scan
+#define TAG_WRITER_QUEUE   2 // Scanned jobs that may wait for the tag writer, per worker
+
+// Writes the tags of scanned jobs on a separate pool of threads, so that the
+// workers can start decoding the next job while TagLib rewrites the files.
+// The queue is bounded, so that a slow disk holds up the workers instead of
+// filling the memory with scanned jobs
+class TagWriter {
+    public:
+        using Clock = std::chrono::steady_clock;
+        using Callback = std::function<void(ScanJob &job, double seconds)>;
+
+        TagWriter(size_t nb_threads, size_t max_queue, Callback done) : max_queue(max_queue), done(std::move(done)), pool(nb_threads) {}
+        void push(std::unique_ptr<ScanJob> job, bool write_tags, Clock::time_point start);
+        void wait() { pool.wait(); }
+
+    private:
+        size_t max_queue;
+        Callback done;
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t queued = 0;
+        ThreadPool pool; // Declared last, so the tasks are finished before the rest is destroyed
+};
 
 class WorkerThread {
 
     public:
-        WorkerThread(std::unique_ptr<ScanJob> &initial_job, std::mutex &main_mutex, std::mutex &ffmpeg_mutex, std::condition_variable &main_cv, ScanData &data)
-        : job(std::move(initial_job)), main_mutex(main_mutex), ffmpeg_mutex(ffmpeg_mutex), main_cv(main_cv), data(data) 
+        WorkerThread(std::unique_ptr<ScanJob> &initial_job, std::mutex &main_mutex, std::mutex &ffmpeg_mutex, std::condition_variable &main_cv, ScanCounters &counters, TagWriter &tag_writer, Metrics *metrics)
+        : job(std::move(initial_job)), main_mutex(main_mutex), ffmpeg_mutex(ffmpeg_mutex), main_cv(main_cv), counters(counters), tag_writer(tag_writer), metrics(metrics)
         {
             thread = std::make_unique<std::thread>(&WorkerThread::work, this);
         }
@@ -25,7 +106,9 @@ class WorkerThread {
         std::mutex &main_mutex;
         std::mutex &ffmpeg_mutex;
         std::condition_variable &main_cv;
-        ScanData &data;
+        ScanCounters &counters;
+        TagWriter &tag_writer;
+        Metrics *metrics;
         std::unique_ptr<std::thread> thread;
         bool quit = false;
         bool job_available = true;
@@ -34,5 +117,5 @@ class WorkerThread {
 };
 
 void easy_mode(int argc, char *argv[]);
-void scan_easy(const std::filesystem::path &path, const std::filesystem::path &preset, size_t nb_threads);
+void scan_easy(const std::filesystem::path &path, const std::filesystem::path &preset, const EasyOptions &options);
 const Config& get_config(FileType type);
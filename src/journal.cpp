@@ -0,0 +1,232 @@
+#include <mutex>
+#include <string>
+#include <thread>
+#include <memory>
+#include <utility>
+#include <filesystem>
+#include <system_error>
+#include <condition_variable>
+#include <stdio.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "rsgain.hpp"
+#include "output.hpp"
+#include "json.hpp"
+#include "journal.hpp"
+
+static size_t get_count(const json::Value &entry, const char *key)
+{
+    const json::Value *value = entry.get(key);
+    return value && value->is(json::Type::NUMBER) && value->number >= 0.0 ? (size_t) value->number : 0;
+}
+
+static double get_total(const json::Value &entry, const char *key)
+{
+    const json::Value *value = entry.get(key);
+    return value && value->is(json::Type::NUMBER) ? value->number : 0.0;
+}
+
+static bool sync_file(std::FILE *stream)
+{
+    if (fflush(stream))
+        return false;
+#ifdef _WIN32
+    return !_commit(_fileno(stream));
+#else
+    return !fsync(fileno(stream));
+#endif
+}
+
+Journal::~Journal()
+{
+    close(false);
+}
+
+// The same directory must have the same key however the run was started
+std::string Journal::key(const std::filesystem::path &directory)
+{
+    std::error_code ec;
+    std::filesystem::path absolute = std::filesystem::absolute(directory, ec);
+    return (ec ? directory : absolute).lexically_normal().string();
+}
+
+// Load the directories completed by previous runs, and start appending to the file
+bool Journal::open(const std::filesystem::path &path)
+{
+    this->path = path;
+    bool exists = std::filesystem::exists(path);
+    if (exists && !load())
+        return false;
+    if (!(stream = fopen(path.string().c_str(), "ab"))) {
+        output_fail("Could not open journal file '{}'", path.string());
+        return false;
+    }
+    if (!exists || !std::filesystem::file_size(path)) {
+        rsgain::print(stream, "{{\"journal\":{}}}\n", JOURNAL_VERSION);
+        if (!sync_file(stream)) {
+            output_fail("Could not write journal file '{}'", path.string());
+            return false;
+        }
+    }
+    writer = std::make_unique<std::thread>(&Journal::write, this);
+    return true;
+}
+
+bool Journal::load()
+{
+    std::FILE *file = fopen(path.string().c_str(), "rb");
+    if (!file) {
+        output_fail("Could not open journal file '{}'", path.string());
+        return false;
+    }
+    std::string content;
+    char buffer[65536];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file)))
+        content.append(buffer, size);
+    fclose(file);
+    if (content.empty())
+        return true;
+
+    json::Value value;
+    std::string error;
+    size_t end = content.find('\n');
+    const json::Value *version;
+    if (end == std::string::npos
+    || !json::parse(std::string_view(content).substr(0, end), value, error)
+    || !(version = value.get("journal"))
+    || !version->is(json::Type::NUMBER)) {
+        output_fail("'{}' is not an rsgain journal", path.string());
+        return false;
+    }
+    if (version->number != JOURNAL_VERSION) {
+        output_fail("Journal '{}' was written by an incompatible version of rsgain", path.string());
+        return false;
+    }
+
+    // A line without a newline at the end was cut off by a crash and is ignored
+    size_t damaged = 0;
+    for (size_t start = end + 1; (end = content.find('\n', start)) != std::string::npos; start = end + 1) {
+        const json::Value *directory;
+        if (!json::parse(std::string_view(content).substr(start, end - start), value, error)
+        || !(directory = value.get("path"))
+        || !directory->is(json::Type::STRING)) {
+            damaged++;
+            continue;
+        }
+        ScanData &data = completed[directory->string];
+        data.files = get_count(value, "files");
+        data.skipped = get_count(value, "skipped");
+        data.clipping_adjustments = get_count(value, "clipping_adjustments");
+        data.total_gain = get_total(value, "total_gain");
+        data.total_peak = get_total(value, "total_peak");
+        data.total_loudness = get_total(value, "total_loudness");
+        data.total_negative = get_count(value, "total_negative");
+        data.total_positive = get_count(value, "total_positive");
+    }
+    if (damaged)
+        output_warn("Ignored {} damaged {} in journal '{}'", damaged, damaged > 1 ? "entries" : "entry", path.string());
+
+    // Start a new line after a line that was cut off
+    if (content.back() != '\n') {
+        if (!(file = fopen(path.string().c_str(), "ab")) || fputc('\n', file) == EOF || fclose(file)) {
+            output_fail("Could not write journal file '{}'", path.string());
+            return false;
+        }
+    }
+    return true;
+}
+
+// If the directory was completed by a previous run, add its statistics to data
+bool Journal::restore(const std::filesystem::path &directory, ScanData &data)
+{
+    auto it = completed.find(key(directory));
+    if (it == completed.end())
+        return false;
+    const ScanData &entry = it->second;
+    data.files += entry.files;
+    data.skipped += entry.skipped;
+    data.clipping_adjustments += entry.clipping_adjustments;
+    data.total_gain += entry.total_gain;
+    data.total_peak += entry.total_peak;
+    data.total_loudness += entry.total_loudness;
+    data.total_negative += entry.total_negative;
+    data.total_positive += entry.total_positive;
+    return true;
+}
+
+// Called by the workers once a job has been tagged. Jobs with errors aren't
+// recorded, so that they are scanned again by the next run
+void Journal::record(ScanJob &job)
+{
+    if (job.error)
+        return;
+    ScanData data;
+    job.update_data(data);
+
+    // Doubles are written with the shortest representation that reads back
+    // exactly, so the restored totals are the same as if the run wasn't interrupted
+    std::string line = rsgain::format("{{\"path\":{},\"files\":{},\"skipped\":{},\"clipping_adjustments\":{},\"total_gain\":{},\"total_peak\":{},\"total_loudness\":{},\"total_negative\":{},\"total_positive\":{}}}\n",
+        json::escape(key(job.path)),
+        data.files,
+        data.skipped,
+        data.clipping_adjustments,
+        json::number(data.total_gain),
+        json::number(data.total_peak),
+        json::number(data.total_loudness),
+        data.total_negative,
+        data.total_positive
+    );
+    {
+        std::scoped_lock lock(mutex);
+        pending += line;
+    }
+    cv.notify_one();
+}
+
+// Lines that are recorded while the writer is syncing are written together
+// with the next sync, so a slow disk doesn't hold up the workers
+void Journal::write()
+{
+    std::unique_lock lock(mutex);
+    while (true) {
+        cv.wait(lock, [this]{ return quit || !pending.empty(); });
+        if (pending.empty())
+            return;
+        std::string batch;
+        batch.swap(pending);
+        lock.unlock();
+        bool ok = fwrite(batch.data(), 1, batch.size(), stream) == batch.size() && sync_file(stream);
+        lock.lock();
+        failed |= !ok;
+    }
+}
+
+// Write the remaining lines and stop the writer. With remove, the journal is
+// deleted since the run has finished
+bool Journal::close(bool remove)
+{
+    if (!writer)
+        return true;
+    {
+        std::scoped_lock lock(mutex);
+        quit = true;
+    }
+    cv.notify_all();
+    writer->join();
+    writer.reset();
+    fclose(stream);
+    stream = nullptr;
+    if (failed) {
+        output_error("Failed to write journal file '{}'", path.string());
+        return false;
+    }
+    std::error_code ec;
+    if (remove)
+        std::filesystem::remove(path, ec);
+    return true;
+}
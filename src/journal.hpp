@@ -0,0 +1,42 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <thread>
+#include <memory>
+#include <filesystem>
+#include <unordered_map>
+#include <condition_variable>
+#include <stdio.h>
+#include "scan.hpp"
+
+#define JOURNAL_VERSION 1
+
+// Append-only log of the directories that have been scanned by Easy Mode,
+// with their statistics, so that an interrupted run can be resumed. The
+// workers only append a line to a buffer, and a writer thread writes and
+// syncs all lines that have accumulated since its last sync at once
+class Journal {
+    public:
+        ~Journal();
+        bool open(const std::filesystem::path &path);
+        bool restore(const std::filesystem::path &directory, ScanData &data);
+        void record(ScanJob &job);
+        bool close(bool remove);
+        size_t size() const { return completed.size(); }
+
+    private:
+        std::filesystem::path path;
+        std::unordered_map<std::string, ScanData> completed;
+        std::FILE *stream = nullptr;
+        std::unique_ptr<std::thread> writer;
+        std::string pending;
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool quit = false;
+        bool failed = false;
+
+        bool load();
+        void write();
+        static std::string key(const std::filesystem::path &directory);
+};
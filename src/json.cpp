@@ -0,0 +1,316 @@
+#include <cmath>
+#include <string>
+#include <vector>
+#include <utility>
+#include <string_view>
+#include <stdlib.h>
+#include <stdint.h>
+#include <locale.h>
+
+#include "rsgain.hpp"
+#include "output.hpp"
+#include "json.hpp"
+
+#define MAX_DEPTH 64
+
+namespace json {
+
+const Value* Value::get(std::string_view key) const
+{
+    for (const auto &[k, v] : object) {
+        if (k == key)
+            return &v;
+    }
+    return nullptr;
+}
+
+class Parser {
+    public:
+        Parser(std::string_view text) : text(text) {}
+        bool parse(Value &value, std::string &error);
+
+    private:
+        std::string_view text;
+        size_t pos = 0;
+        const char *message = nullptr;
+
+        bool fail(const char *msg) { message = msg; return false; }
+        void skip_whitespace();
+        bool parse_value(Value &value, int depth);
+        bool parse_string(std::string &string);
+        bool parse_number(double &number);
+        bool parse_literal(std::string_view literal);
+        bool parse_hex(uint32_t &code);
+        static void append_utf8(std::string &string, uint32_t code);
+};
+
+bool Parser::parse(Value &value, std::string &error)
+{
+    skip_whitespace();
+    if (parse_value(value, 0)) {
+        skip_whitespace();
+        if (pos == text.size())
+            return true;
+        fail("Unexpected data after value");
+    }
+    error = rsgain::format("{} at offset {}", message, pos);
+    return false;
+}
+
+void Parser::skip_whitespace()
+{
+    while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r'))
+        pos++;
+}
+
+bool Parser::parse_value(Value &value, int depth)
+{
+    if (depth > MAX_DEPTH)
+        return fail("Nesting too deep");
+    if (pos == text.size())
+        return fail("Unexpected end of input");
+
+    switch (text[pos]) {
+        case '{':
+            value.type = Type::OBJECT;
+            pos++;
+            skip_whitespace();
+            if (pos < text.size() && text[pos] == '}') {
+                pos++;
+                return true;
+            }
+            while (true) {
+                std::string key;
+                skip_whitespace();
+                if (pos == text.size() || text[pos] != '"')
+                    return fail("Expected string key");
+                if (!parse_string(key))
+                    return false;
+                skip_whitespace();
+                if (pos == text.size() || text[pos] != ':')
+                    return fail("Expected ':'");
+                pos++;
+                skip_whitespace();
+                Value &member = value.object.emplace_back(std::move(key), Value()).second;
+                if (!parse_value(member, depth + 1))
+                    return false;
+                skip_whitespace();
+                if (pos < text.size() && text[pos] == ',') {
+                    pos++;
+                    continue;
+                }
+                if (pos < text.size() && text[pos] == '}') {
+                    pos++;
+                    return true;
+                }
+                return fail("Expected ',' or '}'");
+            }
+
+        case '[':
+            value.type = Type::ARRAY;
+            pos++;
+            skip_whitespace();
+            if (pos < text.size() && text[pos] == ']') {
+                pos++;
+                return true;
+            }
+            while (true) {
+                skip_whitespace();
+                if (!parse_value(value.array.emplace_back(), depth + 1))
+                    return false;
+                skip_whitespace();
+                if (pos < text.size() && text[pos] == ',') {
+                    pos++;
+                    continue;
+                }
+                if (pos < text.size() && text[pos] == ']') {
+                    pos++;
+                    return true;
+                }
+                return fail("Expected ',' or ']'");
+            }
+
+        case '"':
+            value.type = Type::STRING;
+            return parse_string(value.string);
+
+        case 't':
+            value.type = Type::BOOLEAN;
+            value.boolean = true;
+            return parse_literal("true");
+
+        case 'f':
+            value.type = Type::BOOLEAN;
+            return parse_literal("false");
+
+        case 'n':
+            return parse_literal("null");
+
+        default:
+            value.type = Type::NUMBER;
+            return parse_number(value.number);
+    }
+}
+
+bool Parser::parse_literal(std::string_view literal)
+{
+    if (text.substr(pos, literal.size()) != literal)
+        return fail("Invalid literal");
+    pos += literal.size();
+    return true;
+}
+
+bool Parser::parse_number(double &number)
+{
+    size_t start = pos;
+    if (pos < text.size() && text[pos] == '-')
+        pos++;
+    if (pos == text.size() || text[pos] < '0' || text[pos] > '9')
+        return fail("Invalid value");
+    while (pos < text.size() && ((text[pos] >= '0' && text[pos] <= '9') || text[pos] == '.' || text[pos] == 'e'
+    || text[pos] == 'E' || text[pos] == '+' || text[pos] == '-'))
+        pos++;
+
+    // strtod() is locale dependent, so replace the decimal point
+    std::string s(text.substr(start, pos - start));
+    char point = *localeconv()->decimal_point;
+    for (char &c : s) {
+        if (c == '.')
+            c = point;
+    }
+    char *end;
+    number = strtod(s.c_str(), &end);
+    if (*end || !std::isfinite(number))
+        return fail("Invalid number");
+    return true;
+}
+
+bool Parser::parse_hex(uint32_t &code)
+{
+    if (text.size() - pos < 4)
+        return fail("Invalid unicode escape");
+    code = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = text[pos++];
+        code <<= 4;
+        if (c >= '0' && c <= '9')
+            code |= (uint32_t) (c - '0');
+        else if (c >= 'a' && c <= 'f')
+            code |= (uint32_t) (c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F')
+            code |= (uint32_t) (c - 'A' + 10);
+        else
+            return fail("Invalid unicode escape");
+    }
+    return true;
+}
+
+void Parser::append_utf8(std::string &string, uint32_t code)
+{
+    if (code < 0x80)
+        string += (char) code;
+    else if (code < 0x800) {
+        string += (char) (0xC0 | (code >> 6));
+        string += (char) (0x80 | (code & 0x3F));
+    }
+    else if (code < 0x10000) {
+        string += (char) (0xE0 | (code >> 12));
+        string += (char) (0x80 | ((code >> 6) & 0x3F));
+        string += (char) (0x80 | (code & 0x3F));
+    }
+    else {
+        string += (char) (0xF0 | (code >> 18));
+        string += (char) (0x80 | ((code >> 12) & 0x3F));
+        string += (char) (0x80 | ((code >> 6) & 0x3F));
+        string += (char) (0x80 | (code & 0x3F));
+    }
+}
+
+bool Parser::parse_string(std::string &string)
+{
+    pos++;
+    while (pos < text.size()) {
+        char c = text[pos++];
+        if (c == '"')
+            return true;
+        if ((unsigned char) c < 0x20)
+            return fail("Control character in string");
+        if (c != '\\') {
+            string += c;
+            continue;
+        }
+        if (pos == text.size())
+            break;
+        switch (text[pos++]) {
+            case '"':  string += '"';  break;
+            case '\\': string += '\\'; break;
+            case '/':  string += '/';  break;
+            case 'b':  string += '\b'; break;
+            case 'f':  string += '\f'; break;
+            case 'n':  string += '\n'; break;
+            case 'r':  string += '\r'; break;
+            case 't':  string += '\t'; break;
+            case 'u': {
+                uint32_t code;
+                if (!parse_hex(code))
+                    return false;
+
+                // Combine surrogate pairs
+                if (code >= 0xD800 && code < 0xDC00) {
+                    uint32_t low;
+                    if (text.substr(pos, 2) != "\\u")
+                        return fail("Invalid surrogate pair");
+                    pos += 2;
+                    if (!parse_hex(low) || low < 0xDC00 || low > 0xDFFF)
+                        return fail("Invalid surrogate pair");
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                }
+                else if (code >= 0xDC00 && code <= 0xDFFF)
+                    return fail("Invalid surrogate pair");
+                append_utf8(string, code);
+                break;
+            }
+            default:
+                return fail("Invalid escape sequence");
+        }
+    }
+    return fail("Unterminated string");
+}
+
+bool parse(std::string_view text, Value &value, std::string &error)
+{
+    value = Value();
+    return Parser(text).parse(value, error);
+}
+
+// Quoted JSON string
+std::string escape(std::string_view string)
+{
+    std::string s;
+    s.reserve(string.size() + 2);
+    s += '"';
+    for (char c : string) {
+        switch (c) {
+            case '"':  s += "\\\""; break;
+            case '\\': s += "\\\\"; break;
+            case '\n': s += "\\n";  break;
+            case '\r': s += "\\r";  break;
+            case '\t': s += "\\t";  break;
+            default:
+                if ((unsigned char) c < 0x20)
+                    s += rsgain::format("\\u{:04x}", (unsigned int) c);
+                else
+                    s += c;
+        }
+    }
+    s += '"';
+    return s;
+}
+
+// JSON has no representation for infinity, e.g. the loudness of a silent track
+std::string number(double value)
+{
+    return std::isfinite(value) ? rsgain::format("{}", value) : "null";
+}
+
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <string_view>
+
+// Minimal JSON support for the server protocol: a DOM parser for requests and
+// an escape function for building responses
+namespace json {
+    enum class Type {
+        NUL,
+        BOOLEAN,
+        NUMBER,
+        STRING,
+        ARRAY,
+        OBJECT
+    };
+
+    struct Value {
+        Type type = Type::NUL;
+        bool boolean = false;
+        double number = 0.0;
+        std::string string;
+        std::vector<Value> array;
+        std::vector<std::pair<std::string, Value>> object;
+
+        const Value* get(std::string_view key) const;
+        bool is(Type t) const { return type == t; }
+    };
+
+    bool parse(std::string_view text, Value &value, std::string &error);
+    std::string escape(std::string_view string);
+    std::string number(double value);
+}
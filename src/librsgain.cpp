@@ -0,0 +1,239 @@
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <string>
+#include <utility>
+#include <filesystem>
+#include <unordered_set>
+#include <condition_variable>
+
+#include <config.h>
+#include "rsgain.hpp"
+#include "scan.hpp"
+#include "output.hpp"
+#include "threadpool.hpp"
+#include "librsgain.h"
+
+struct rsgain_pool {
+    ThreadPool threads;
+    rsgain_pool(size_t nb_threads) : threads(nb_threads) {}
+};
+
+// Serializes the FFmpeg initialization in Track::scan across all calls
+static std::mutex ffmpeg_mutex;
+
+// Status messages and progress bars are only meant for the command line
+static void init_library()
+{
+    static std::once_flag flag;
+    std::call_once(flag, []{
+        quiet = 1;
+        multithread = true;
+    });
+}
+
+static Config convert_config(const rsgain_config &c)
+{
+    return {
+        .tag_mode = c.tag_mode,
+        .skip_existing = false,
+        .target_loudness = c.target_loudness,
+        .max_peak_level = c.max_peak_level,
+        .true_peak = c.true_peak != 0,
+        .clip_mode = c.clip_mode,
+        .do_album = c.do_album != 0,
+        .album_as_aes77 = c.album_as_aes77 != 0,
+        .tab_output = OutputType::NONE,
+        .sep_header = false,
+        .sort_alphanum = false,
+        .lowercase = c.lowercase != 0,
+        .id3v2version = c.id3v2version,
+        .opus_mode = c.opus_mode,
+        .skip_mp4 = false,
+        .preserve_mtimes = c.preserve_mtimes != 0,
+        .dual_mono = c.dual_mono != 0
+    };
+}
+
+static bool valid_config(const rsgain_config *c)
+{
+    return c
+        && (c->tag_mode == 's' || c->tag_mode == 'i' || c->tag_mode == 'd')
+        && (c->clip_mode == 'n' || c->clip_mode == 'p' || c->clip_mode == 'a')
+        && (c->opus_mode == 'd' || c->opus_mode == 'r' || c->opus_mode == 's' || c->opus_mode == 't' || c->opus_mode == 'a')
+        && (c->id3v2version == ID3V2_KEEP || c->id3v2version == 3 || c->id3v2version == 4);
+}
+
+// Scan the tracks as one job, in parallel if a pool was given
+static int scan_tracks(std::vector<ScanJob::Track> &tracks, const Config &config, rsgain_pool *pool, rsgain_result *results)
+{
+    size_t nb_tracks = tracks.size();
+    std::unordered_set<FileType> types;
+    for (const ScanJob::Track &track : tracks)
+        types.insert(track.type);
+    ScanJob job(tracks, config, types.size() > 1 ? FileType::DEFAULT : *types.begin());
+
+    std::vector<ScanReturn> returns(nb_tracks, ScanReturn::SUCCESS);
+    if (job.needs_scan()) {
+        if (pool) {
+            std::mutex mutex;
+            std::condition_variable cv;
+            size_t remaining = nb_tracks;
+            for (size_t i = 0; i < nb_tracks; i++) {
+                pool->threads.submit([&, i]{
+                    returns[i] = job.scan_track(i, &ffmpeg_mutex);
+                    std::scoped_lock lock(mutex);
+                    if (!--remaining)
+                        cv.notify_all();
+                });
+            }
+            std::unique_lock lock(mutex);
+            cv.wait(lock, [&]{ return !remaining; });
+        }
+        else {
+            for (size_t i = 0; i < nb_tracks; i++)
+                returns[i] = job.scan_track(i, &ffmpeg_mutex);
+        }
+    }
+
+    // Without album gain, a file that failed doesn't affect the others
+    int rc = RSGAIN_OK;
+    std::vector<int> status(nb_tracks, RSGAIN_OK);
+    for (size_t i = 0; i < nb_tracks; i++) {
+        if (returns[i] == ScanReturn::SUCCESS)
+            continue;
+        status[i] = returns[i] == ScanReturn::ERR ? RSGAIN_ERROR_SCAN : RSGAIN_NO_AUDIO;
+        if (rc == RSGAIN_OK)
+            rc = status[i];
+        if (!config.do_album)
+            returns[i] = ScanReturn::NO_STREAM;
+    }
+    if (!job.finish_scan(returns)) {
+        for (size_t i = 0; i < nb_tracks; i++) {
+            results[i] = {};
+            results[i].status = RSGAIN_ERROR_SCAN;
+        }
+        return RSGAIN_ERROR_SCAN;
+    }
+
+    job.tag_tracks(false);
+    if (job.error && rc == RSGAIN_OK)
+        rc = RSGAIN_ERROR_TAG;
+
+    // Tracks without a result were removed from the job
+    size_t index = 0;
+    for (size_t i = 0; i < nb_tracks; i++) {
+        results[i] = {};
+        results[i].status = status[i];
+        if (status[i] != RSGAIN_OK || !job.needs_scan())
+            continue;
+        const ScanJob::Track &track = job.get_track(index++);
+        results[i].track_gain = track.result.track_gain;
+        results[i].track_peak = track.result.track_peak;
+        results[i].track_loudness = track.result.track_loudness;
+        results[i].track_clip_adjusted = track.tclip;
+        if (config.do_album) {
+            results[i].album_gain = track.result.album_gain;
+            results[i].album_peak = track.result.album_peak;
+            results[i].album_loudness = track.result.album_loudness;
+            results[i].album_clip_adjusted = track.aclip;
+        }
+    }
+    return rc;
+}
+
+const char* rsgain_version(void)
+{
+    return PROJECT_VERSION;
+}
+
+void rsgain_config_init(rsgain_config *config)
+{
+    if (!config)
+        return;
+    *config = {
+        .tag_mode = 's',
+        .target_loudness = RG_TARGET_LOUDNESS,
+        .max_peak_level = 0.0,
+        .true_peak = 0,
+        .clip_mode = 'n',
+        .do_album = 0,
+        .album_as_aes77 = 0,
+        .lowercase = 0,
+        .id3v2version = ID3V2_KEEP,
+        .opus_mode = 'd',
+        .preserve_mtimes = 0,
+        .dual_mono = 0
+    };
+}
+
+rsgain_pool* rsgain_pool_create(size_t nb_threads)
+{
+    try {
+        return new rsgain_pool(nb_threads);
+    }
+    catch (...) {
+        return nullptr;
+    }
+}
+
+void rsgain_pool_destroy(rsgain_pool *pool)
+{
+    delete pool;
+}
+
+int rsgain_scan_file(const char *path, const rsgain_config *config, rsgain_pool *pool, rsgain_result *result)
+{
+    return rsgain_scan_files(&path, 1, config, pool, result);
+}
+
+int rsgain_scan_files(const char *const *paths, size_t nb_files, const rsgain_config *config, rsgain_pool *pool, rsgain_result *results)
+{
+    if (!paths || !nb_files || !results || !valid_config(config))
+        return RSGAIN_ERROR_ARGUMENT;
+    init_library();
+
+    try {
+        std::vector<ScanJob::Track> tracks;
+        tracks.reserve(nb_files);
+        for (size_t i = 0; i < nb_files; i++) {
+            if (!paths[i])
+                return RSGAIN_ERROR_ARGUMENT;
+            std::filesystem::path path(paths[i]);
+            FileType type = determine_filetype(path.extension().string());
+            if (type == FileType::INVALID)
+                return RSGAIN_ERROR_UNSUPPORTED;
+            tracks.emplace_back(path, type);
+        }
+        Config c = convert_config(*config);
+        return scan_tracks(tracks, c, pool, results);
+    }
+    catch (...) {
+        return RSGAIN_ERROR_SCAN;
+    }
+}
+
+int rsgain_scan_buffer(const void *data, size_t size, const char *format, const rsgain_config *config, rsgain_result *result)
+{
+    if (!data || !size || !result || !valid_config(config))
+        return RSGAIN_ERROR_ARGUMENT;
+    init_library();
+
+    try {
+        FileType type = format ? determine_filetype(std::string(".") + format) : FileType::DEFAULT;
+        if (type == FileType::INVALID)
+            type = FileType::DEFAULT;
+        std::vector<ScanJob::Track> tracks;
+        ScanJob::Track &track = tracks.emplace_back(std::filesystem::path(), type);
+        track.buffer = static_cast<const uint8_t*>(data);
+        track.buffer_size = size;
+
+        Config c = convert_config(*config);
+        c.tag_mode = 's';
+        c.preserve_mtimes = false;
+        return scan_tracks(tracks, c, nullptr, result);
+    }
+    catch (...) {
+        return RSGAIN_ERROR_SCAN;
+    }
+}
@@ -0,0 +1,93 @@
+/*
+ * librsgain - C interface to the rsgain scanning core
+ *
+ * All functions are thread safe. No status messages are printed; the
+ * outcome of each call is reported through its return value.
+ */
+
+#ifndef LIBRSGAIN_H
+#define LIBRSGAIN_H
+
+#include <stddef.h>
+
+#if defined(_WIN32) && defined(RSGAIN_SHARED)
+#ifdef RSGAIN_BUILDING_LIBRARY
+#define RSGAIN_API __declspec(dllexport)
+#else
+#define RSGAIN_API __declspec(dllimport)
+#endif
+#elif defined(RSGAIN_SHARED) && defined(__GNUC__)
+#define RSGAIN_API __attribute__((visibility("default")))
+#else
+#define RSGAIN_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum rsgain_status {
+    RSGAIN_OK = 0,
+    RSGAIN_ERROR_ARGUMENT,    /* Invalid argument */
+    RSGAIN_ERROR_UNSUPPORTED, /* File type is not supported */
+    RSGAIN_ERROR_SCAN,        /* File could not be opened or decoded */
+    RSGAIN_ERROR_TAG,         /* Tags could not be written */
+    RSGAIN_NO_AUDIO           /* File has no audio stream, result is not set */
+};
+
+/* Scan settings, see the options of Custom Mode. Initialize with rsgain_config_init() */
+typedef struct rsgain_config {
+    char tag_mode;             /* 's': scan only, 'i': write tags, 'd': delete tags */
+    double target_loudness;    /* LUFS */
+    double max_peak_level;     /* dB */
+    int true_peak;
+    char clip_mode;            /* 'n', 'p' or 'a' */
+    int do_album;
+    int album_as_aes77;
+    int lowercase;
+    unsigned int id3v2version; /* 0 to keep the file's version, 3 or 4 */
+    char opus_mode;            /* 'd', 'r', 's', 't' or 'a' */
+    int preserve_mtimes;
+    int dual_mono;
+} rsgain_config;
+
+typedef struct rsgain_result {
+    int status;                /* enum rsgain_status */
+    double track_gain;         /* dB */
+    double track_peak;         /* Linear */
+    double track_loudness;     /* LUFS */
+    double album_gain;         /* Only set if do_album */
+    double album_peak;
+    double album_loudness;
+    int track_clip_adjusted;
+    int album_clip_adjusted;
+} rsgain_result;
+
+/* A set of threads that can be shared by any number of calls. A NULL pool
+   scans on the calling thread */
+typedef struct rsgain_pool rsgain_pool;
+
+RSGAIN_API const char* rsgain_version(void);
+RSGAIN_API void rsgain_config_init(rsgain_config *config);
+
+RSGAIN_API rsgain_pool* rsgain_pool_create(size_t nb_threads);
+RSGAIN_API void rsgain_pool_destroy(rsgain_pool *pool);
+
+/* Scan a single file. Returns an rsgain_status */
+RSGAIN_API int rsgain_scan_file(const char *path, const rsgain_config *config, rsgain_pool *pool, rsgain_result *result);
+
+/* Scan a list of files as one job (one album if config->do_album). results
+   must hold nb_files entries. Returns RSGAIN_OK if all files were scanned,
+   otherwise the status of the first file that failed */
+RSGAIN_API int rsgain_scan_files(const char *const *paths, size_t nb_files, const rsgain_config *config, rsgain_pool *pool, rsgain_result *results);
+
+/* Scan a file that is held in memory. format is the file's extension
+   (e.g. "flac") or NULL. Tags can't be written to a buffer, so the tag mode
+   is ignored */
+RSGAIN_API int rsgain_scan_buffer(const void *data, size_t size, const char *format, const rsgain_config *config, rsgain_result *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
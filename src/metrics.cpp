@@ -0,0 +1,201 @@
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <functional>
+#include <filesystem>
+#include <condition_variable>
+#include <stdio.h>
+
+#include "rsgain.hpp"
+#include "output.hpp"
+#include "metrics.hpp"
+
+static uint64_t to_ns(double seconds)
+{
+    return seconds > 0.0 ? (uint64_t) (seconds * 1e9) : 0;
+}
+
+static void put_header(std::string &out, const char *name, const char *type, const char *help)
+{
+    out += rsgain::format("# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+}
+
+template <typename T>
+static void put_metric(std::string &out, const char *name, const char *type, const char *help, T value)
+{
+    put_header(out, name, type, help);
+    out += rsgain::format("{} {}\n", name, value);
+}
+
+void Histogram::observe(double seconds)
+{
+    size_t i = 0;
+    while (i < std::size(bounds) && seconds > bounds[i])
+        i++;
+    counts[i].fetch_add(1, std::memory_order_relaxed);
+    sum_ns.fetch_add(to_ns(seconds), std::memory_order_relaxed);
+}
+
+// The buckets of the text format are cumulative
+void Histogram::write(std::string &out, const char *name, const char *label) const
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i <= std::size(bounds); i++) {
+        total += counts[i].load(std::memory_order_relaxed);
+        out += rsgain::format("{}_bucket{{{},le=\"{}\"}} {}\n", name, label, i < std::size(bounds) ? rsgain::format("{}", bounds[i]) : "+Inf", total);
+    }
+    out += rsgain::format("{}_sum{{{}}} {}\n", name, label, (double) sum_ns.load(std::memory_order_relaxed) / 1e9);
+    out += rsgain::format("{}_count{{{}}} {}\n", name, label, total);
+}
+
+Metrics::Metrics(const std::filesystem::path &path, const ScanCounters &counters)
+: path(path), counters(counters) {}
+
+Metrics::~Metrics()
+{
+    stop();
+}
+
+// Write the file once, so that an invalid path is reported before scanning,
+// and then update it every METRICS_INTERVAL seconds. The sample function is
+// called before each update, e.g. to collect values from a thread pool
+bool Metrics::start(std::function<void(Metrics&)> sample)
+{
+    this->sample = std::move(sample);
+    start_time = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+    if (!write(true)) {
+        output_fail("Could not write metrics file '{}'", path.string());
+        return false;
+    }
+    thread = std::make_unique<std::thread>(&Metrics::run, this);
+    return true;
+}
+
+// Stop the updates and write the final values. Returns false if any update failed
+bool Metrics::stop()
+{
+    if (!thread)
+        return true;
+    {
+        std::scoped_lock lock(mutex);
+        quit = true;
+    }
+    cv.notify_all();
+    thread->join();
+    thread.reset();
+    if (sample)
+        sample(*this);
+    queue_depth = 0;
+    workers = 0;
+    if (!write(false) || failed) {
+        output_error("Failed to update metrics file '{}'", path.string());
+        return false;
+    }
+    return true;
+}
+
+void Metrics::run()
+{
+    std::unique_lock lock(mutex);
+    while (!cv.wait_for(lock, std::chrono::seconds(METRICS_INTERVAL), [this]{ return quit; })) {
+        if (sample)
+            sample(*this);
+        failed |= !write(true);
+    }
+}
+
+// Called once a job has been scanned and tagged
+void Metrics::record_job(const ScanJob &job, double seconds)
+{
+    files_skipped.fetch_add(job.skipped, std::memory_order_relaxed);
+    if (job.error)
+        files_failed.fetch_add(job.nb_files, std::memory_order_relaxed);
+    else
+        files_scanned.fetch_add(job.nb_files, std::memory_order_relaxed);
+    if (!job.nb_files)
+        return;
+
+    tag_writes.fetch_add(job.tag_writes, std::memory_order_relaxed);
+    for (size_t i = 0; i < job.nb_tracks(); i++) {
+        if (job.get_track(i).scan_time > 0.0)
+            decode_time.observe(job.get_track(i).scan_time);
+    }
+    if (job.tag_time > 0.0)
+        tag_time.observe(job.tag_time);
+    job_time.observe(seconds);
+}
+
+// Add the time a worker spent scanning and waiting for a job
+void Metrics::add_worker_time(double busy, double idle)
+{
+    busy_ns.fetch_add(to_ns(busy), std::memory_order_relaxed);
+    idle_ns.fetch_add(to_ns(idle), std::memory_order_relaxed);
+}
+
+// Replace the totals of all workers, for pools that keep their own
+void Metrics::set_worker_time(double busy, double idle)
+{
+    busy_ns.store(to_ns(busy), std::memory_order_relaxed);
+    idle_ns.store(to_ns(idle), std::memory_order_relaxed);
+}
+
+void Metrics::set_queue(size_t depth, size_t workers)
+{
+    queue_depth.store(depth, std::memory_order_relaxed);
+    this->workers.store(workers, std::memory_order_relaxed);
+}
+
+void Metrics::set_page_cache(uint64_t held, uint64_t dropped)
+{
+    page_cache_held.store(held, std::memory_order_relaxed);
+    page_cache_dropped.store(dropped, std::memory_order_relaxed);
+    page_cache.store(true, std::memory_order_relaxed);
+}
+
+// Replace the file with the current values. The temporary file is in the same
+// directory, and isn't read by the collector since it doesn't end in .prom
+bool Metrics::write(bool running)
+{
+    std::string out;
+    put_metric(out, "rsgain_running", "gauge", "Whether the scan is still running.", (int) running);
+    put_metric(out, "rsgain_start_time_seconds", "gauge", "Start time of the scan since the Unix epoch.", start_time);
+    put_metric(out, "rsgain_files_scanned_total", "counter", "Files that were scanned successfully.", files_scanned.load(std::memory_order_relaxed));
+    put_metric(out, "rsgain_files_skipped_total", "counter", "Files that were skipped because they already had ReplayGain information.", files_skipped.load(std::memory_order_relaxed));
+    put_metric(out, "rsgain_files_failed_total", "counter", "Files that could not be scanned or tagged.", files_failed.load(std::memory_order_relaxed));
+    put_metric(out, "rsgain_read_bytes_total", "counter", "Bytes read from audio files.", counters.bytes.load(std::memory_order_relaxed));
+    put_metric(out, "rsgain_audio_seconds_total", "counter", "Duration of the decoded audio.", (double) counters.audio_ns.load(std::memory_order_relaxed) / 1e9);
+    put_metric(out, "rsgain_probe_bytes_total", "counter", "Bytes read to find the stream parameters of the files.", counters.probe_bytes.load(std::memory_order_relaxed));
+    put_metric(out, "rsgain_probe_fallbacks_total", "counter", "Files whose fast probe failed and that were probed again in full.", counters.probe_fallbacks.load(std::memory_order_relaxed));
+    put_metric(out, "rsgain_read_wait_seconds_total", "counter", "Time spent in av_read_frame(), summed over all workers.", (double) counters.read_wait_ns.load(std::memory_order_relaxed) / 1e9);
+    put_metric(out, "rsgain_tag_writes_total", "counter", "Files whose tags were written.", tag_writes.load(std::memory_order_relaxed));
+    put_metric(out, "rsgain_worker_busy_seconds_total", "counter", "Time the workers spent scanning, summed over all workers.", (double) busy_ns.load(std::memory_order_relaxed) / 1e9);
+    put_metric(out, "rsgain_worker_idle_seconds_total", "counter", "Time the workers spent waiting for a job, summed over all workers.", (double) idle_ns.load(std::memory_order_relaxed) / 1e9);
+    put_metric(out, "rsgain_queue_depth", "gauge", "Jobs waiting to be scanned.", queue_depth.load(std::memory_order_relaxed));
+    put_metric(out, "rsgain_workers", "gauge", "Active worker threads.", workers.load(std::memory_order_relaxed));
+    if (page_cache.load(std::memory_order_relaxed)) {
+        put_metric(out, "rsgain_page_cache_held_bytes", "gauge", "Size of the files of the jobs that haven't been dropped from the page cache.", page_cache_held.load(std::memory_order_relaxed));
+        put_metric(out, "rsgain_page_cache_dropped_bytes_total", "counter", "Resident bytes of the files that were dropped from the page cache.", page_cache_dropped.load(std::memory_order_relaxed));
+    }
+    put_header(out, "rsgain_stage_duration_seconds", "histogram", "Duration of the stages of a scan: decode per file, tag and job per directory or album.");
+    decode_time.write(out, "rsgain_stage_duration_seconds", "stage=\"decode\"");
+    tag_time.write(out, "rsgain_stage_duration_seconds", "stage=\"tag\"");
+    job_time.write(out, "rsgain_stage_duration_seconds", "stage=\"job\"");
+
+    std::filesystem::path temp = path;
+    temp += ".tmp";
+    std::FILE *stream = fopen(temp.string().c_str(), "wb");
+    if (!stream)
+        return false;
+    bool ok = fwrite(out.data(), 1, out.size(), stream) == out.size();
+    ok &= !fclose(stream);
+    std::error_code ec;
+    if (ok)
+        std::filesystem::rename(temp, path, ec);
+    if (!ok || ec) {
+        std::filesystem::remove(temp, ec);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <iterator>
+#include <functional>
+#include <filesystem>
+#include <condition_variable>
+#include <stdint.h>
+#include "scan.hpp"
+
+#define METRICS_INTERVAL 15 // Seconds between updates of the metrics file
+
+// Distribution of durations with fixed buckets. Observations only do relaxed
+// atomic adds, so the workers can record them without a lock
+class Histogram {
+    public:
+        void observe(double seconds);
+        void write(std::string &out, const char *name, const char *label) const;
+
+    private:
+        static constexpr double bounds[] = {0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0, 300.0};
+        std::atomic<uint64_t> counts[std::size(bounds) + 1] = {}; // Not cumulative, the last one is +Inf
+        std::atomic<uint64_t> sum_ns = 0;
+};
+
+// Statistics of a long-running scan, which are periodically written to a file
+// in the Prometheus text format for the textfile collector of node_exporter.
+// The file is replaced atomically, so the collector never reads a partial file
+class Metrics {
+    public:
+        Metrics(const std::filesystem::path &path, const ScanCounters &counters);
+        ~Metrics();
+        bool start(std::function<void(Metrics&)> sample = nullptr);
+        bool stop();
+        void record_job(const ScanJob &job, double seconds);
+        void add_worker_time(double busy, double idle);
+        void set_worker_time(double busy, double idle);
+        void set_queue(size_t depth, size_t workers);
+        void set_page_cache(uint64_t held, uint64_t dropped);
+
+    private:
+        std::filesystem::path path;
+        const ScanCounters &counters;
+        std::function<void(Metrics&)> sample;
+        double start_time = 0.0;
+        std::atomic<uint64_t> files_scanned = 0;
+        std::atomic<uint64_t> files_skipped = 0;
+        std::atomic<uint64_t> files_failed = 0;
+        std::atomic<uint64_t> tag_writes = 0;
+        std::atomic<uint64_t> busy_ns = 0;
+        std::atomic<uint64_t> idle_ns = 0;
+        std::atomic<uint64_t> queue_depth = 0;
+        std::atomic<uint64_t> workers = 0;
+        std::atomic<uint64_t> page_cache_held = 0;
+        std::atomic<uint64_t> page_cache_dropped = 0;
+        std::atomic<bool> page_cache = false;
+        Histogram decode_time;
+        Histogram tag_time;
+        Histogram job_time;
+        std::unique_ptr<std::thread> thread;
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool quit = false;
+        bool failed = false;
+
+        void run();
+        bool write(bool running);
+};
@@ -51,17 +51,12 @@
 #include "output.hpp"
 #include "config.h"
 
-#define MT_MESSAGE " Scanning directory: "
-
-constexpr int str_literal_len(const char *str)
-{
-	return *str ? 1 + str_literal_len(str + 1) : 0;
-}
-
+// The console width is only looked up once per file, as update() is called for every frame
 void ProgressBar::begin(int start, int len)
 {
 	this->start = start;
 	this->len = len;
+	width = get_console_width();
 }
 
 void ProgressBar::update(int pos)
@@ -70,7 +65,7 @@ void ProgressBar::update(int pos)
 	if (pos == pos_prev || !len)
 		return;
 
-	w = get_console_width();
+	w = width;
 #ifdef MAXPROGBARWIDTH
 	if (w > MAXPROGBARWIDTH)
 		w = MAXPROGBARWIDTH;
@@ -120,7 +115,7 @@ void ProgressBar::complete()
 	rsgain::print("\n");
 }
 
-inline int ProgressBar::get_console_width()
+int ProgressBar::get_console_width()
 {
 #ifdef _WIN32
 	GetConsoleScreenBufferInfo(console, &info);
@@ -131,42 +126,3 @@ inline int ProgressBar::get_console_width()
 	return ws.ws_col;
 #endif
 }
-
-void MTProgress::update(const std::string &path)
-{
-	if (quiet)
-		return;
-	static constexpr int w_message = 7 + str_literal_len(MT_MESSAGE);
-	int w_console = ProgressBar::get_console_width();
-	if (!w_console)
-		return;
-	int w_path = utf8_length(path);
-	if (w_path + w_message >= w_console)
-		w_path = w_console - w_message;
-
-	rsgain::print("\33[2K " COLOR_GREEN "{:5.1f}%" COLOR_OFF  MT_MESSAGE "{:.{}}\r", 
-		100.f * ((float) (cur) / (float) (total)), 
-		path,
-		w_path < 0 ? 0 : w_path
-	);
-	fflush(stdout);
-	cur++;
-}
-
-int MTProgress::utf8_length(std::string_view string)
-{
-    int length = 0;
-    auto it = string.cbegin();
-    while (it < string.cend()) {
-        if ((*it & 0x80) == 0) // If byte is 0xxxxxxx, then it's a 1 byte (ASCII) char
-            it++;
-        else if ((*it & 0xE0) == 0xC0) // If byte is 110xxxxx, then it's a 2 byte char
-            it +=2;
-        else if ((*it & 0xF0) == 0xE0) // If byte is 1110xxxx, then it's a 3 byte char
-            it +=3;
-        else if ((*it & 0xF8) == 0xF0 || 1) // If byte is 11110xxx, then it's a 4 byte char
-            it +=4;
-        length++;
-    }
-    return length;
-}
@@ -111,6 +111,7 @@ class ProgressBar {
         int pos_prev = -1;
         int start;
         int len = 0;
+        int width = 0;
         char *buffer = nullptr;
 
 #ifdef _WIN32
@@ -130,14 +131,3 @@ class ProgressBar {
 #endif
 };
 
-class MTProgress {
-    private:
-        size_t total;
-        int cur = 0;
-
-        int utf8_length(std::string_view string);
-    
-    public:
-        MTProgress(size_t total) : total(total) {}
-        void update(const std::string &path);
-};
@@ -0,0 +1,100 @@
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "rsgain.hpp"
+#include "pagecache.hpp"
+
+#ifndef _WIN32
+static uint64_t count_resident(int fd, uint64_t size)
+{
+    if (!size)
+        return 0;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return 0;
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> pages((size + page_size - 1) / page_size);
+    uint64_t resident = 0;
+#ifdef __APPLE__
+    if (!mincore(map, size, reinterpret_cast<char*>(pages.data()))) {
+#else
+    if (!mincore(map, size, pages.data())) {
+#endif
+        for (unsigned char page : pages)
+            resident += page & 1;
+    }
+    munmap(map, size);
+    return std::min(resident * page_size, size);
+}
+#endif
+
+// Returns the number of bytes of the file that were in the page cache
+static uint64_t release_file([[maybe_unused]] const std::filesystem::path &path)
+{
+    uint64_t resident = 0;
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    if (!fstat(fd, &st)) {
+        resident = count_resident(fd, (uint64_t) st.st_size);
+
+        // Dirty pages aren't dropped, so the tags that were written are
+        // flushed first
+#ifdef __linux__
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    }
+    close(fd);
+#endif
+    return resident;
+}
+
+// Jobs that are counted already are ignored, so that it can be called again
+// for a job that no worker could take
+void PageCache::begin(const ScanJob &job)
+{
+    uint64_t size = 0;
+    {
+        std::scoped_lock lock(mutex);
+        auto [it, inserted] = jobs.try_emplace(&job);
+        if (!inserted)
+            return;
+        for (size_t i = 0; i < job.nb_tracks(); i++) {
+            const ScanJob::Track &track = job.get_track(i);
+            it->second.paths.push_back(track.path);
+            size += track.size;
+        }
+        it->second.size = size;
+    }
+    uint64_t held = nb_held.fetch_add(size, std::memory_order_relaxed) + size;
+    uint64_t peak = nb_peak.load(std::memory_order_relaxed);
+    while (held > peak && !nb_peak.compare_exchange_weak(peak, held, std::memory_order_relaxed));
+}
+
+void PageCache::release(const ScanJob &job)
+{
+    Files files;
+    {
+        std::scoped_lock lock(mutex);
+        auto it = jobs.find(&job);
+        if (it == jobs.end())
+            return;
+        files = std::move(it->second);
+        jobs.erase(it);
+    }
+    for (const std::filesystem::path &path : files.paths)
+        nb_resident.fetch_add(release_file(path), std::memory_order_relaxed);
+    nb_held.fetch_sub(files.size, std::memory_order_relaxed);
+}
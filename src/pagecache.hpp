@@ -0,0 +1,38 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <filesystem>
+#include <unordered_map>
+#include <stdint.h>
+#include "scan.hpp"
+
+// Keeps the files of a scan from building up in the page cache, so that the
+// working set of other programs on the host isn't evicted. Once a job has been
+// scanned and tagged, the pages of its files are counted with mincore() and
+// released with posix_fadvise(POSIX_FADV_DONTNEED). The files of the jobs in
+// between are all that the scan holds in the page cache, apart from prefetching.
+// begin() must be called before the job is handed to a worker, which removes
+// the tracks that are skipped or have no audio stream. Their files have been
+// read by then too, so release() drops the files that begin() counted
+class PageCache {
+    public:
+        void begin(const ScanJob &job);
+        void release(const ScanJob &job);
+        uint64_t held() const { return nb_held.load(std::memory_order_relaxed); }
+        uint64_t peak() const { return nb_peak.load(std::memory_order_relaxed); }
+        uint64_t resident() const { return nb_resident.load(std::memory_order_relaxed); }
+
+    private:
+        struct Files {
+            std::vector<std::filesystem::path> paths;
+            uint64_t size = 0;
+        };
+
+        std::mutex mutex;
+        std::unordered_map<const ScanJob*, Files> jobs;
+        std::atomic<uint64_t> nb_held = 0;     // Size of the files of the started jobs that haven't been released
+        std::atomic<uint64_t> nb_peak = 0;
+        std::atomic<uint64_t> nb_resident = 0; // Bytes that were resident when their job was released
+};
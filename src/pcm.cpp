@@ -0,0 +1,414 @@
+#include <bit>
+#include <cmath>
+#include <numbers>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "pcm.hpp"
+
+static uint16_t load_u16(const uint8_t *p, bool big_endian)
+{
+    return big_endian ? (uint16_t) (p[0] << 8 | p[1]) : (uint16_t) (p[1] << 8 | p[0]);
+}
+
+static uint32_t load_u32(const uint8_t *p, bool big_endian)
+{
+    return big_endian ? (uint32_t) load_u16(p, true) << 16 | load_u16(p + 2, true)
+                      : (uint32_t) load_u16(p + 2, false) << 16 | load_u16(p, false);
+}
+
+static uint64_t load_u64(const uint8_t *p, bool big_endian)
+{
+    return big_endian ? (uint64_t) load_u32(p, true) << 32 | load_u32(p + 4, true)
+                      : (uint64_t) load_u32(p + 4, false) << 32 | load_u32(p, false);
+}
+
+// The sample rate of AIFF is an 80 bit extended precision float
+static double load_extended(const uint8_t *p)
+{
+    int exponent = (p[0] & 0x7f) << 8 | p[1];
+    uint64_t mantissa = load_u64(p + 2, true);
+    if (!exponent && !mantissa)
+        return 0.0;
+    double value = std::ldexp((double) mantissa, exponent - 16383 - 63);
+    return p[0] & 0x80 ? -value : value;
+}
+
+template <typename T>
+static T* resize(std::vector<uint8_t> &buffer, size_t nb_samples)
+{
+    buffer.resize(nb_samples * sizeof(T));
+    return reinterpret_cast<T*>(buffer.data());
+}
+
+PCMReader::~PCMReader()
+{
+    close();
+}
+
+bool PCMReader::open([[maybe_unused]] const std::filesystem::path &path)
+{
+#ifdef _WIN32
+    return false;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < 12 || (uintmax_t) st.st_size > SIZE_MAX) {
+        ::close(fd);
+        return false;
+    }
+    void *p = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    map = static_cast<const uint8_t*>(p);
+    map_size = (size_t) st.st_size;
+#ifdef MADV_SEQUENTIAL
+    madvise(p, map_size, MADV_SEQUENTIAL);
+#endif
+
+    if (!(!memcmp(map, "FORM", 4) ? parse_aiff() : !memcmp(map, "DSD ", 4) ? parse_dsf() : parse_wav())) {
+        close();
+        return false;
+    }
+    return true;
+#endif
+}
+
+void PCMReader::close()
+{
+#ifndef _WIN32
+    if (map)
+        munmap(const_cast<uint8_t*>(map), map_size);
+#endif
+    map = data = nullptr;
+    map_size = 0;
+}
+
+bool PCMReader::parse_wav()
+{
+    bool rf64 = !memcmp(map, "RF64", 4) || !memcmp(map, "BW64", 4);
+    if ((memcmp(map, "RIFF", 4) && !rf64) || memcmp(map + 8, "WAVE", 4))
+        return false;
+
+    // The sizes of RF64 files over 4 GiB are in the ds64 chunk
+    uint64_t rf64_data_size = 0;
+    const uint8_t *fmt = nullptr;
+    uint64_t fmt_size = 0;
+    uint64_t pos = 12;
+    while (pos + 8 <= map_size) {
+        const uint8_t *chunk = map + pos;
+        uint64_t size = load_u32(chunk + 4, false);
+        if (!memcmp(chunk, "ds64", 4) && size >= 16 && pos + 24 <= map_size)
+            rf64_data_size = load_u64(chunk + 16, false);
+        else if (!memcmp(chunk, "fmt ", 4) && size >= 16 && pos + 8 + size <= map_size) {
+            fmt = chunk + 8;
+            fmt_size = size;
+        }
+        else if (!memcmp(chunk, "data", 4)) {
+            if (!fmt)
+                return false;
+            if (rf64 && size == 0xffffffff)
+                size = rf64_data_size;
+
+            unsigned int tag = load_u16(fmt, false);
+            unsigned int channels = load_u16(fmt + 2, false);
+            unsigned int block_align = load_u16(fmt + 12, false);
+            if (tag == 0xfffe && fmt_size >= 40) // WAVE_FORMAT_EXTENSIBLE, the tag starts the sub-format GUID
+                tag = load_u16(fmt + 24, false);
+            if ((tag != 1 && tag != 3) || !channels || block_align % channels)
+                return false;
+            unsigned int bits = block_align / channels * 8; // Of the container, the samples are left-justified
+            Encoding encoding = tag == 3 ? Encoding::FLOAT : bits == 8 ? Encoding::UNSIGNED : Encoding::SIGNED;
+            format = "wav";
+            return set_format(channels, load_u32(fmt + 4, false), bits, encoding, false, pos + 8, size);
+        }
+        pos += 8 + size + (size & 1);
+    }
+    return false;
+}
+
+bool PCMReader::parse_aiff()
+{
+    bool aifc = !memcmp(map + 8, "AIFC", 4);
+    if (memcmp(map + 8, "AIFF", 4) && !aifc)
+        return false;
+
+    const uint8_t *comm = nullptr;
+    uint64_t pos = 12;
+    while (pos + 8 <= map_size) {
+        const uint8_t *chunk = map + pos;
+        uint64_t size = load_u32(chunk + 4, true);
+        if (!memcmp(chunk, "COMM", 4) && size >= (aifc ? 22u : 18u) && pos + 8 + size <= map_size)
+            comm = chunk + 8;
+        else if (!memcmp(chunk, "SSND", 4) && size >= 8 && pos + 16 <= map_size) {
+            if (!comm)
+                return false;
+
+            // Uncompressed AIFC is big-endian, except for 'sowt'
+            Encoding encoding = Encoding::SIGNED;
+            bool big_endian = true;
+            unsigned int bits = (load_u16(comm + 6, true) + 7) / 8 * 8;
+            if (aifc) {
+                const uint8_t *compression = comm + 18;
+                if (!memcmp(compression, "sowt", 4))
+                    big_endian = false;
+                else if (!memcmp(compression, "fl32", 4) || !memcmp(compression, "FL32", 4)) {
+                    encoding = Encoding::FLOAT;
+                    bits = 32;
+                }
+                else if (!memcmp(compression, "fl64", 4) || !memcmp(compression, "FL64", 4)) {
+                    encoding = Encoding::FLOAT;
+                    bits = 64;
+                }
+                else if (memcmp(compression, "NONE", 4) && memcmp(compression, "twos", 4))
+                    return false;
+            }
+            uint64_t offset = load_u32(chunk + 8, true);
+            if (offset > size - 8)
+                return false;
+            uint64_t data_size = std::min<uint64_t>(size - 8 - offset, (uint64_t) load_u32(comm + 2, true) * load_u16(comm, true) * (bits / 8));
+            double sample_rate = load_extended(comm + 8);
+            if (!(sample_rate >= 1.0 && sample_rate <= 4294967295.0))
+                return false;
+            format = "aiff";
+            return set_format(load_u16(comm, true), (unsigned int) std::lround(sample_rate), bits, encoding, big_endian, pos + 16 + offset, data_size);
+        }
+        pos += 8 + size + (size & 1);
+    }
+    return false;
+}
+
+bool PCMReader::set_format(unsigned int channels, unsigned int sample_rate, unsigned int bits, Encoding encoding, bool big_endian, uint64_t offset, uint64_t size)
+{
+    if (!channels || !sample_rate || offset > map_size)
+        return false;
+    if (encoding == Encoding::FLOAT) {
+        if (bits != 32 && bits != 64)
+            return false;
+        sample_type = bits == 32 ? SampleType::FLOAT : SampleType::DOUBLE;
+    }
+    else {
+        if (bits != 8 && bits != 16 && bits != 24 && bits != 32)
+            return false;
+        sample_type = bits <= 16 ? SampleType::SHORT : SampleType::INT;
+    }
+    this->channels = channels;
+    this->sample_rate = sample_rate;
+    bits_per_sample = bits;
+    this->encoding = encoding;
+    this->big_endian = big_endian;
+    data = map + offset;
+
+    // A file that was cut off ends with the last whole frame
+    nb_frames = std::min<uint64_t>(size, map_size - offset) / frame_size();
+    frame = 0;
+    end_frame = nb_frames;
+    return true;
+}
+
+// DSF stores the channels in blocks of dsd_block bytes each, one after the
+// other. The bits are decimated by a linear phase low-pass FIR filter. A
+// byte holds 8 bits under the filter, so its contribution to the output is
+// looked up in a table, and each output frame takes one lookup per byte of
+// the filter and channel
+bool PCMReader::parse_dsf()
+{
+    if (map_size < 92 || memcmp(map + 28, "fmt ", 4))
+        return false;
+    const uint8_t *fmt = map + 28;
+    uint64_t fmt_size = load_u64(fmt + 4, false);
+    if (fmt_size < 52 || fmt_size > map_size - 40 || load_u32(fmt + 16, false) != 0) // DSD raw
+        return false;
+    unsigned int channels = load_u32(fmt + 24, false);
+    unsigned int rate = load_u32(fmt + 28, false);
+    unsigned int bits = load_u32(fmt + 32, false);
+    uint64_t nb_samples = load_u64(fmt + 36, false);
+    size_t block = load_u32(fmt + 44, false);
+    const uint8_t *chunk = fmt + fmt_size;
+    if (!channels || channels > 8 || (bits != 1 && bits != 8) || !block || memcmp(chunk, "data", 4))
+        return false;
+
+    // Decimate by a power of two, to the highest rate that the meter takes
+    // without oversampling the true peak more than twice
+    unsigned int factor = 8;
+    while (rate / factor > DSD_MAX_RATE)
+        factor *= 2;
+    if (!rate || rate % factor)
+        return false;
+
+    // A file that was cut off ends with the last whole block
+    data = chunk + 12;
+    uint64_t available = (map_size - (size_t) (data - map)) / (block * channels) * block;
+    dsd_bytes = std::min((nb_samples + 7) / 8, available);
+    dsd_block = block;
+    dsd_step = factor / 8;
+    dsd_taps = DSD_TAPS_PER_FACTOR * factor / 8;
+    this->channels = channels;
+    sample_rate = rate / factor;
+    dsd_rate = rate;
+    bits_per_sample = 1;
+    encoding = Encoding::DSD;
+    big_endian = bits == 8;
+    sample_type = SampleType::FLOAT;
+    format = "dsf";
+    nb_frames = std::min(nb_samples, dsd_bytes * 8) / factor;
+    frame = 0;
+    end_frame = nb_frames;
+
+    // Blackman windowed sinc, with its cutoff at 0.4 of the output rate. The
+    // gain is 1 for DC, so full scale DSD reads as full scale PCM
+    size_t length = dsd_taps * 8;
+    std::vector<double> coeffs(length);
+    double cutoff = 0.4 / factor;
+    double sum = 0.0;
+    for (size_t i = 0; i < length; i++) {
+        double x = (double) i - (double) (length - 1) / 2.0;
+        double w = 2.0 * std::numbers::pi * (double) i / (double) (length - 1);
+        double sinc = x == 0.0 ? 2.0 * cutoff : std::sin(2.0 * std::numbers::pi * cutoff * x) / (std::numbers::pi * x);
+        coeffs[i] = sinc * (0.42 - 0.5 * std::cos(w) + 0.08 * std::cos(2.0 * w));
+        sum += coeffs[i];
+    }
+    dsd_table.resize(dsd_taps * 256);
+    for (size_t k = 0; k < dsd_taps; k++) {
+        for (unsigned int value = 0; value < 256; value++) {
+            double out = 0.0;
+            for (unsigned int j = 0; j < 8; j++) {
+                bool bit = value >> (big_endian ? 7 - j : j) & 1;
+                out += (bit ? coeffs[8 * k + j] : -coeffs[8 * k + j]) / sum;
+            }
+            dsd_table[k * 256 + value] = (float) out;
+        }
+    }
+    return true;
+}
+
+// Read only the frames from start to end
+void PCMReader::seek(uint64_t start, uint64_t end)
+{
+    end_frame = std::min(end, nb_frames);
+    frame = std::min(start, end_frame);
+}
+
+// The next block of up to PCM_BLOCK_FRAMES frames, or nullptr at the end
+const void* PCMReader::read(size_t &frames)
+{
+    frames = (size_t) std::min<uint64_t>(end_frame - frame, PCM_BLOCK_FRAMES);
+    if (!frames)
+        return nullptr;
+    if (encoding == Encoding::DSD) {
+        const void *out = read_dsd(frames);
+        frame += frames;
+        return out;
+    }
+    const uint8_t *in = data + frame * frame_size();
+    size_t nb_samples = frames * channels;
+    size_t bytes = bits_per_sample / 8;
+    frame += frames;
+
+    // Samples in native byte order can be metered from the mapping
+    if (bits_per_sample >= 16 && bits_per_sample != 24 && big_endian == (std::endian::native == std::endian::big) && !((uintptr_t) in % bytes))
+        return in;
+
+    switch (bits_per_sample) {
+        case 8:
+            {
+                int16_t *out = resize<int16_t>(buffer, nb_samples);
+                for (size_t i = 0; i < nb_samples; i++)
+                    out[i] = (int16_t) ((encoding == Encoding::UNSIGNED ? (int) in[i] - 128 : (int) (int8_t) in[i]) * 256);
+            }
+            break;
+
+        case 16:
+            {
+                int16_t *out = resize<int16_t>(buffer, nb_samples);
+                for (size_t i = 0; i < nb_samples; i++)
+                    out[i] = (int16_t) load_u16(in + 2 * i, big_endian);
+            }
+            break;
+
+        // Scaled to 32 bit, which the meter takes
+        case 24:
+            {
+                int32_t *out = resize<int32_t>(buffer, nb_samples);
+                for (size_t i = 0; i < nb_samples; i++) {
+                    const uint8_t *p = in + 3 * i;
+                    out[i] = (int32_t) (big_endian ? (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8
+                                                   : (uint32_t) p[2] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[0] << 8);
+                }
+            }
+            break;
+
+        case 32:
+            {
+                uint32_t *out = resize<uint32_t>(buffer, nb_samples);
+                for (size_t i = 0; i < nb_samples; i++)
+                    out[i] = load_u32(in + 4 * i, big_endian);
+            }
+            break;
+
+        case 64:
+            {
+                uint64_t *out = resize<uint64_t>(buffer, nb_samples);
+                for (size_t i = 0; i < nb_samples; i++)
+                    out[i] = load_u64(in + 8 * i, big_endian);
+            }
+            break;
+    }
+    return buffer.data();
+}
+
+const void* PCMReader::read_dsd(size_t frames)
+{
+    // Gather the bytes under the filter for all output frames, interleaved, so
+    // that each lookup table is used for all channels in turn. The filter runs
+    // over DSD silence before the start and after the end of the file
+    int64_t begin = (int64_t) (frame * dsd_step + dsd_step) - (int64_t) dsd_taps;
+    size_t span = frames * dsd_step + dsd_taps - dsd_step;
+    window.resize(span * channels);
+    for (unsigned int c = 0; c < channels; c++) {
+        size_t i = 0;
+        while (i < span) {
+            int64_t index = begin + (int64_t) i;
+            if (index < 0 || (uint64_t) index >= dsd_bytes) {
+                window[i++ * channels + c] = 0x69;
+                continue;
+            }
+            size_t offset = (size_t) index % dsd_block;
+            size_t run = (size_t) std::min<uint64_t>({dsd_block - offset, span - i, dsd_bytes - (uint64_t) index});
+            const uint8_t *in = data + ((size_t) index - offset) * channels + c * dsd_block + offset;
+            for (size_t j = 0; j < run; j++)
+                window[(i + j) * channels + c] = in[j];
+            i += run;
+        }
+    }
+
+    // Four sums per channel, so that the additions don't wait for each other
+    float *out = resize<float>(buffer, frames * channels);
+    for (size_t n = 0; n < frames; n++) {
+        const uint8_t *in = window.data() + n * dsd_step * channels;
+        float acc[4][8] = {};
+        for (size_t k = 0; k < dsd_taps; k += 4) {
+            const float *table = dsd_table.data() + k * 256;
+            for (unsigned int c = 0; c < channels; c++) {
+                acc[0][c] += table[in[k * channels + c]];
+                acc[1][c] += table[256 + in[(k + 1) * channels + c]];
+                acc[2][c] += table[512 + in[(k + 2) * channels + c]];
+                acc[3][c] += table[768 + in[(k + 3) * channels + c]];
+            }
+        }
+        for (unsigned int c = 0; c < channels; c++)
+            out[n * channels + c] = (acc[0][c] + acc[1][c]) + (acc[2][c] + acc[3][c]);
+    }
+    return buffer.data();
+}
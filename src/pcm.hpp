@@ -0,0 +1,78 @@
+#pragma once
+
+#include <vector>
+#include <filesystem>
+#include <stdint.h>
+#include <stddef.h>
+
+#define PCM_BLOCK_FRAMES 65536 // Frames passed to the meter at once
+#define DSD_MAX_RATE 96000     // DSD is decimated to the highest rate below this
+#define DSD_TAPS_PER_FACTOR 16 // Length of the decimation filter, in multiples of the factor
+
+// Reads the samples of an uncompressed WAV (including RF64 and
+// WAVE_FORMAT_EXTENSIBLE), AIFF or DSF file from a memory mapping of the file,
+// without FFmpeg. Samples that the meter can take as they are stored are
+// returned as pointers into the mapping, the others are converted a block
+// at a time. The 1 bit DSD of DSF files is low-pass filtered and decimated to
+// 88.2 or 96 kHz float. open() returns false for anything else, e.g. a
+// compressed format, so that the file can be decoded with FFmpeg instead
+class PCMReader {
+    public:
+        enum class SampleType {
+            SHORT,
+            INT,
+            FLOAT,
+            DOUBLE
+        };
+
+        enum class Encoding {
+            SIGNED,
+            UNSIGNED,
+            FLOAT,
+            DSD
+        };
+
+        unsigned int channels = 0;
+        unsigned int sample_rate = 0;     // Of the samples that are returned
+        unsigned int bits_per_sample = 0; // Of the container
+        Encoding encoding = Encoding::SIGNED;
+        bool big_endian = false;          // For DSD, the first bit of a byte is the most significant one
+        unsigned int dsd_rate = 0;        // Of the 1 bit stream
+        uint64_t nb_frames = 0;
+        SampleType sample_type = SampleType::SHORT;
+
+        PCMReader() = default;
+        PCMReader(const PCMReader&) = delete;
+        PCMReader& operator=(const PCMReader&) = delete;
+        ~PCMReader();
+        bool open(const std::filesystem::path &path);
+        const void* read(size_t &frames);
+        void seek(uint64_t start, uint64_t end = UINT64_MAX);
+        uint64_t position() const { return frame; }
+        size_t frame_size() const { return encoding == Encoding::DSD ? channels * dsd_step : channels * (bits_per_sample / 8); }
+        const char* format_name() const { return format; }
+
+    private:
+        const uint8_t *map = nullptr;
+        size_t map_size = 0;
+        const uint8_t *data = nullptr;
+        uint64_t frame = 0;
+        uint64_t end_frame = 0;
+        const char *format = nullptr;
+        std::vector<uint8_t> buffer;
+
+        // DSD decimation
+        size_t dsd_block = 0;      // Bytes per channel in each block of the file
+        size_t dsd_step = 0;       // Bytes per channel for each output frame
+        size_t dsd_taps = 0;       // Bytes per channel under the filter
+        uint64_t dsd_bytes = 0;    // Per channel, without the padding of the last block
+        std::vector<float> dsd_table; // The filter response to each byte value, for each byte under the filter
+        std::vector<uint8_t> window;  // The bytes under the filter, interleaved
+
+        bool parse_wav();
+        bool parse_aiff();
+        bool parse_dsf();
+        const void* read_dsd(size_t frames);
+        bool set_format(unsigned int channels, unsigned int sample_rate, unsigned int bits, Encoding encoding, bool big_endian, uint64_t offset, uint64_t size);
+        void close();
+};
@@ -0,0 +1,96 @@
+#include <mutex>
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "rsgain.hpp"
+#include "prefetch.hpp"
+
+static void prefetch_file([[maybe_unused]] const std::filesystem::path &path, [[maybe_unused]] uint64_t size)
+{
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+#if defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(fd, 0, (off_t) size, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE) // macOS
+    struct radvisory advisory = {0, (int) std::min<uint64_t>(size, std::numeric_limits<int>::max())};
+    fcntl(fd, F_RDADVISE, &advisory);
+#endif
+    close(fd);
+#endif
+}
+
+Prefetcher::Prefetcher(uint64_t budget) : budget(budget), thread(&Prefetcher::run, this) {}
+
+Prefetcher::~Prefetcher()
+{
+    {
+        std::scoped_lock lock(mutex);
+        quit = true;
+    }
+    cv.notify_all();
+    thread.join();
+}
+
+// Files that are already queued stay queued when the budget is lowered, but no
+// more are queued until the outstanding bytes are below the new budget
+void Prefetcher::set_budget(uint64_t budget)
+{
+    std::scoped_lock lock(mutex);
+    this->budget = budget;
+}
+
+// Called when a job is handed to a worker, with the jobs that will follow it.
+// The bytes of the started job are no longer ahead of the workers, so the
+// budget they took is used for the files of the upcoming jobs
+void Prefetcher::update(const ScanJob *started, const std::vector<const ScanJob*> &upcoming)
+{
+    {
+        std::scoped_lock lock(mutex);
+        auto it = jobs.find(started);
+        if (it != jobs.end()) {
+            outstanding -= it->second.bytes;
+            jobs.erase(it);
+        }
+        for (const ScanJob *job : upcoming) {
+            Progress &progress = jobs[job];
+            for (; progress.files < job->nb_tracks(); progress.files++) {
+                const ScanJob::Track &track = job->get_track(progress.files);
+                if (outstanding + track.size > budget)
+                    goto done;
+                files.push_back({job, track.path, track.size});
+                progress.bytes += track.size;
+                outstanding += track.size;
+            }
+        }
+    }
+done:
+    cv.notify_one();
+}
+
+void Prefetcher::run()
+{
+    std::unique_lock lock(mutex);
+    while (true) {
+        cv.wait(lock, [this]{ return quit || !files.empty(); });
+        if (quit)
+            return;
+        File file = std::move(files.front());
+        files.pop_front();
+
+        // Too late once a worker has started the job
+        if (!jobs.contains(file.job))
+            continue;
+        lock.unlock();
+        prefetch_file(file.path, file.size);
+        nb_bytes.fetch_add(file.size, std::memory_order_relaxed);
+        lock.lock();
+    }
+}
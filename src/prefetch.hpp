@@ -0,0 +1,51 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <filesystem>
+#include <unordered_map>
+#include <condition_variable>
+#include <stdint.h>
+#include "scan.hpp"
+
+#define PREFETCH_JOBS 16 // Upcoming jobs whose files may be prefetched
+
+// Warms the page cache with the files of the jobs that the workers will scan
+// next, so that they don't start with a cold read. The kernel is asked to read
+// the files ahead with posix_fadvise(POSIX_FADV_WILLNEED), on a thread of its
+// own since opening a file on a network filesystem takes a round trip. At most
+// budget bytes are prefetched ahead of the jobs that have been started
+class Prefetcher {
+    public:
+        Prefetcher(uint64_t budget);
+        ~Prefetcher();
+        void update(const ScanJob *started, const std::vector<const ScanJob*> &upcoming);
+        void set_budget(uint64_t budget);
+        uint64_t total() const { return nb_bytes.load(std::memory_order_relaxed); }
+
+    private:
+        struct Progress {
+            size_t files = 0; // Of the job that have been queued
+            uint64_t bytes = 0;
+        };
+        struct File {
+            const ScanJob *job;
+            std::filesystem::path path;
+            uint64_t size;
+        };
+
+        uint64_t budget;
+        uint64_t outstanding = 0; // Queued for jobs that haven't been started
+        std::unordered_map<const ScanJob*, Progress> jobs;
+        std::deque<File> files;
+        std::atomic<uint64_t> nb_bytes = 0;
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool quit = false;
+        std::thread thread; // Declared last, so that it starts after the rest is initialized
+
+        void run();
+};
@@ -0,0 +1,95 @@
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <algorithm>
+#include <condition_variable>
+#include <stdio.h>
+
+#include "rsgain.hpp"
+#include "output.hpp"
+#include "progress.hpp"
+
+ProgressMonitor::ProgressMonitor(const ScanCounters &counters, uint64_t total_files, uint64_t total_size)
+: counters(counters), total_files(total_files), total_size(total_size) {}
+
+ProgressMonitor::~ProgressMonitor()
+{
+    stop();
+}
+
+void ProgressMonitor::start()
+{
+    if (quiet || thread || !ProgressBar::get_console_width())
+        return;
+    start_time = last_time = Clock::now();
+    thread = std::make_unique<std::thread>(&ProgressMonitor::run, this);
+}
+
+// Stop redrawing and clear the status line
+void ProgressMonitor::stop()
+{
+    if (!thread)
+        return;
+    {
+        std::scoped_lock lock(mutex);
+        quit = true;
+    }
+    cv.notify_all();
+    thread->join();
+    thread.reset();
+    rsgain::print("\33[2K");
+    fflush(stdout);
+}
+
+void ProgressMonitor::run()
+{
+    std::unique_lock lock(mutex);
+    while (!cv.wait_for(lock, std::chrono::milliseconds(PROGRESS_INTERVAL), [this]{ return quit; }))
+        render();
+}
+
+static std::string format_duration(double seconds)
+{
+    auto s = (uint64_t) seconds;
+    return rsgain::format("{:02}:{:02}:{:02}", s / 3600, s / 60 % 60, s % 60);
+}
+
+void ProgressMonitor::render()
+{
+    Clock::time_point now = Clock::now();
+    double elapsed = std::chrono::duration<double>(now - start_time).count();
+    double interval = std::chrono::duration<double>(now - last_time).count();
+    uint64_t files = counters.files.load(std::memory_order_relaxed);
+    uint64_t bytes = counters.bytes.load(std::memory_order_relaxed);
+    uint64_t size_done = std::min(counters.size_done.load(std::memory_order_relaxed), total_size);
+    double audio = (double) counters.audio_ns.load(std::memory_order_relaxed) / 1e9;
+
+    // The ETA is weighted by file size, since a long file takes longer to scan
+    // than a short one. It follows the recent throughput, so it adapts when
+    // e.g. the scan moves from a fast disk to a slow one
+    double instant = interval > 0.0 ? (double) (size_done - last_size) / interval : 0.0;
+    if (elapsed < PROGRESS_ETA_WINDOW)
+        rate = elapsed > 0.0 ? (double) size_done / elapsed : 0.0;
+    else
+        rate += (instant - rate) * std::min(1.0, interval / PROGRESS_ETA_WINDOW);
+    last_time = now;
+    last_size = size_done;
+
+    double fraction = total_size ? (double) size_done / (double) total_size : (total_files ? (double) files / (double) total_files : 0.0);
+    std::string eta = rate > 0.0 && size_done ? format_duration((double) (total_size - size_done) / rate) : "--:--:--";
+    std::string line = rsgain::format(" {:5.1f}%  {:L}/{:L} files  {:.1f} MB/s  {:.0f}x realtime  ETA {}",
+        100.0 * fraction,
+        files,
+        total_files,
+        elapsed > 0.0 ? (double) bytes / elapsed / 1e6 : 0.0,
+        elapsed > 0.0 ? audio / elapsed : 0.0,
+        eta
+    );
+    int width = ProgressBar::get_console_width();
+    if (width > 1 && line.size() >= (size_t) width)
+        line.resize((size_t) width - 1);
+    rsgain::print("\33[2K" COLOR_GREEN "{}" COLOR_OFF "\r", line);
+    fflush(stdout);
+}
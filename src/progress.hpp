@@ -0,0 +1,41 @@
+#pragma once
+
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <condition_variable>
+#include <stdint.h>
+#include "scan.hpp"
+
+#define PROGRESS_INTERVAL   250  // Milliseconds between redraws
+#define PROGRESS_ETA_WINDOW 30.0 // Seconds of recent throughput that the ETA is based on
+
+// Status line of a multithreaded scan. The workers only add to the atomic
+// ScanCounters, and a separate thread reads them and redraws at a fixed rate
+class ProgressMonitor {
+    public:
+        ProgressMonitor(const ScanCounters &counters, uint64_t total_files, uint64_t total_size);
+        ~ProgressMonitor();
+        void start();
+        void stop();
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        const ScanCounters &counters;
+        uint64_t total_files;
+        uint64_t total_size;
+        Clock::time_point start_time;
+        Clock::time_point last_time;
+        uint64_t last_size = 0;
+        double rate = 0.0; // Bytes per second, averaged over PROGRESS_ETA_WINDOW
+        std::unique_ptr<std::thread> thread;
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool quit = false;
+
+        void run();
+        void render();
+};
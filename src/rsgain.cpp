@@ -36,7 +36,10 @@
 #include <getopt.h>
 #include <cmath>
 #include <string>
+#include <vector>
 #include <locale>
+#include <fstream>
+#include <iostream>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -57,6 +60,10 @@ extern "C" {
 #include "scan.hpp"
 #include "output.hpp"
 #include "easymode.hpp"
+#include "customscan.hpp"
+#include "sink.hpp"
+#include "server.hpp"
+#include "concurrency.hpp"
 
 #define PRINT_LIB(lib, version) rsgain::print("  " COLOR_YELLOW " {:<14}" COLOR_OFF " {}\n", lib, version)
 #define PRINT_LIB_FFMPEG(name, fn) \
@@ -73,7 +80,6 @@ static void help_main();
 static void version();
 static inline void help_custom();
 
-int quiet = 0;
 
 #ifdef _WIN32
 BOOL initial_cursor_visibility;
@@ -99,6 +105,8 @@ static void set_cursor_visibility(HANDLE console, BOOL setting, BOOL* previous)
 
 void quit(int status)
 {
+    if (!result_sink.close() && status == EXIT_SUCCESS)
+        status = EXIT_FAILURE;
 #ifdef _WIN32
     if (initial_cursor_visibility)
         set_cursor_visibility(GetStdHandle(STD_OUTPUT_HANDLE), TRUE, nullptr);
@@ -175,14 +183,92 @@ std::pair<bool, bool> parse_output_mode(const std::string_view arg)
     return ret;
 }
 
+// The tab-delimited table is the default, so it's returned as NONE
+bool parse_output_format(const char *value, OutputType &format)
+{
+    if (MATCH(value, "tsv"))
+        format = OutputType::NONE;
+    else if (MATCH(value, "ndjson"))
+        format = OutputType::NDJSON;
+    else if (MATCH(value, "columnar"))
+        format = OutputType::COLUMNAR;
+    else {
+        output_error("Invalid output format '{}'; only 'tsv', 'ndjson', and 'columnar' are supported.", value);
+        return false;
+    }
+    return true;
+}
+
+// Scan the files listed in a file, or stdin if list is "-". Groups of files are
+// separated by an empty entry (a blank line, or two NULs in a row), and each group
+// is scanned as one job, i.e. as one album with -a
+static void scan_files_from(const char *list, char delimiter, const Config &config, size_t nb_threads, bool split_tracks)
+{
+    std::ifstream file;
+    bool from_stdin = MATCH(list, "-");
+    if (!from_stdin) {
+        file.open(list, std::ios::binary);
+        if (!file) {
+            output_fail("Could not open file list '{}'", list);
+            quit(EXIT_FAILURE);
+        }
+    }
+    std::istream &stream = from_stdin ? std::cin : file;
+    CustomScanner scanner(nb_threads, split_tracks);
+
+    std::vector<std::string> files;
+    std::string entry;
+    size_t nb_groups = 0;
+    size_t nb_invalid = 0;
+    auto scan_group = [&]() {
+        if (files.empty())
+            return;
+        nb_groups++;
+        std::unique_ptr<ScanJob> job(ScanJob::factory(files, config));
+        files.clear();
+        if (!job) {
+            output_error("File list of group {} is not valid", nb_groups);
+            nb_invalid++;
+            return;
+        }
+        scanner.submit(std::move(job));
+    };
+
+    // Groups are scanned as soon as they are complete, so the list can be streamed
+    while (std::getline(stream, entry, delimiter)) {
+        if (delimiter == '\n' && !entry.empty() && entry.back() == '\r')
+            entry.pop_back();
+        if (entry.empty())
+            scan_group();
+        else
+            files.push_back(std::move(entry));
+    }
+    scan_group();
+
+    if (!nb_groups) {
+        output_fail("No files were specified");
+        quit(EXIT_FAILURE);
+    }
+    size_t nb_errors = nb_invalid + scanner.finish();
+    if (nb_errors) {
+        output_error("{} of {} groups failed", nb_errors, nb_groups);
+        quit(EXIT_FAILURE);
+    }
+}
+
 // Parse Custom Mode command line arguments
 static void custom_mode(int argc, char *argv[])
 {
     int rc, i;
     unsigned int nb_files   = 0;
+    const char *files_from = nullptr;
+    char delimiter = '\n';
+    unsigned int threads = 1;
+    bool split_tracks = false;
+    OutputType format = OutputType::NONE;
     opterr = 0;
 
-    const char *short_opts = "+aec:m:tdl:O::qps:LSI:o:h?";
+    const char *short_opts = "+aec:m:tdl:O::F:qps:LSI:o:f:0M:Th?";
     static struct option long_opts[] = {
         { "album",           no_argument,       nullptr, 'a' },
         { "album-aes77",     no_argument,       nullptr, 'e' },
@@ -196,6 +282,7 @@ static void custom_mode(int argc, char *argv[])
         { "loudness",        required_argument, nullptr, 'l' },
 
         { "output",          optional_argument, nullptr, 'O' },
+        { "output-format",   required_argument, nullptr, 'F' },
         { "quiet",           no_argument,       nullptr, 'q' },
         { "preserve-mtimes", no_argument,       nullptr, 'p' },
 
@@ -203,6 +290,10 @@ static void custom_mode(int argc, char *argv[])
         { "lowercase",       no_argument,       nullptr, 'L' },
         { "id3v2-version",   required_argument, nullptr, 'I' },
         { "opus-mode",       required_argument, nullptr, 'o' },
+        { "files-from",      required_argument, nullptr, 'f' },
+        { "null",            no_argument,       nullptr, '0' },
+        { "multithread",     required_argument, nullptr, 'M' },
+        { "split-tracks",    no_argument,       nullptr, 'T' },
         { "help",            no_argument,       nullptr, 'h' },
         { 0, 0, 0, 0 }
     };
@@ -279,6 +370,11 @@ static void custom_mode(int argc, char *argv[])
                 quiet = 1;
                 break;
 
+            case 'F':
+                if (!parse_output_format(optarg, format))
+                    quit(EXIT_FAILURE);
+                break;
+
             case 'q':
                 quiet = 1;
                 break;
@@ -306,6 +402,37 @@ static void custom_mode(int argc, char *argv[])
                 if (!parse_opus_mode(optarg, config.opus_mode))
                     quit(EXIT_FAILURE);
                 break;
+
+            case 'f':
+                files_from = optarg;
+                break;
+
+            case '0':
+                delimiter = '\0';
+                break;
+
+            case 'M':
+                {
+                    unsigned int max_threads = get_resource_limits().cpus;
+                    if (MATCH(optarg, "MAX") || MATCH(optarg, "max"))
+                        threads = max_threads;
+                    else {
+                        threads = (unsigned int) (strtoul(optarg, nullptr, 10));
+                        if (threads < 1) {
+                            output_fail("Invalid multithread argument '{}'", optarg);
+                            quit(EXIT_FAILURE);
+                        }
+                        else if (threads > max_threads) {
+                            output_warn("{} threads were requested, but only {} are available", threads, max_threads);
+                            threads = max_threads;
+                        }
+                    }
+                }
+                break;
+
+            case 'T':
+                split_tracks = true;
+                break;
                 
             case 'h':
                 help_custom();
@@ -321,7 +448,26 @@ static void custom_mode(int argc, char *argv[])
         }
     }
 
+    // Tracks are decoded in parallel, but tagged and printed in order on one thread
+    multithread = threads > 1;
+
+    // The records of all jobs are written to stdout by one thread
+    if (format != OutputType::NONE) {
+        config.tab_output = format;
+        quiet = 1;
+        if (!result_sink.open("-", format == OutputType::NDJSON ? SinkFormat::NDJSON : SinkFormat::COLUMNAR))
+            quit(EXIT_FAILURE);
+    }
+
     nb_files = (unsigned int) (argc - optind);
+    if (files_from) {
+        if (nb_files) {
+            output_fail("Files can't be listed on the command line with --files-from");
+            quit(EXIT_FAILURE);
+        }
+        scan_files_from(files_from, delimiter, config, threads, split_tracks);
+        return;
+    }
     if (!nb_files) {
         output_fail("No files were specified");
         quit(EXIT_FAILURE);
@@ -332,8 +478,9 @@ static void custom_mode(int argc, char *argv[])
         output_fail("File list is not valid");
         quit(EXIT_FAILURE);
     }
-    job->scan();
-    if (job->error)
+    CustomScanner scanner(threads, split_tracks);
+    scanner.submit(std::move(job));
+    if (scanner.finish())
         quit(EXIT_FAILURE);
 }
 
@@ -392,6 +539,8 @@ int main(int argc, char *argv[]) {
         easy_mode(num_subargs, subargs);
     else if (MATCH(command, "custom"))
         custom_mode(num_subargs, subargs);
+    else if (MATCH(command, "serve"))
+        serve(num_subargs, subargs);
     else {
         output_fail("Invalid command '{}'", command);
         quit(EXIT_FAILURE);
@@ -424,8 +573,9 @@ static void help_main() {
 
     CMD_CMD("easy",     "Easy Mode:   Recursively scan a directory with recommended settings");
     CMD_CMD("custom",   "Custom Mode: Scan individual files with custom settings");
+    CMD_CMD("serve",    "Server Mode: Scan files for clients of a Unix socket");
     rsgain::print("\n");
-    rsgain::print("Run '{} easy --help' or '{} custom --help' for more information.", EXECUTABLE_TITLE, EXECUTABLE_TITLE);
+    rsgain::print("Run '{} easy --help', '{} custom --help' or '{} serve --help' for more information.", EXECUTABLE_TITLE, EXECUTABLE_TITLE, EXECUTABLE_TITLE);
 
     rsgain::print("\n\n");
     rsgain::print("Please report any issues to " PROJECT_URL "/issues\n\n");
@@ -433,9 +583,11 @@ static void help_main() {
 
 static inline void help_custom() {
     rsgain::print(COLOR_RED "Usage: " COLOR_OFF "{}{}{} custom [OPTIONS] FILES...\n", COLOR_GREEN, EXECUTABLE_TITLE, COLOR_OFF);
+    rsgain::print("       {}{}{} custom [OPTIONS] --files-from=FILE\n", COLOR_GREEN, EXECUTABLE_TITLE, COLOR_OFF);
 
     rsgain::print("  Custom Mode allows the user to specify the options to scan the files with. The\n");
-    rsgain::print("  list of files to scan must be listed explicitly after the options.\n");
+    rsgain::print("  list of files to scan must be listed explicitly after the options, or read from\n");
+    rsgain::print("  a file with --files-from.\n");
     rsgain::print("\n");
     
     rsgain::print(COLOR_RED "Options:\n" COLOR_OFF);
@@ -483,6 +635,14 @@ static inline void help_custom() {
     CMD_HELP("--output", "-O",  "Output tab-delimited scan data to stdout");
     CMD_HELP("--output=s", "-O s",  "Output with sep header (needed for Microsoft Excel compatibility)");
     CMD_HELP("--output=a", "-O a",  "Output with files sorted in alphanumeric order");
+    CMD_HELP("--output-format=f", "-F f",  "Output format: 'tsv' (default), 'ndjson' or 'columnar' (binary)");
+
+    CMD_HELP("--files-from=f", "-f f", "Read the files to scan from f, one per line ('-' for stdin)");
+    CMD_CONT("A blank line starts a new group, which is scanned as a separate album");
+    CMD_HELP("--null", "-0", "Files in the list are separated by NUL instead of newline");
+    CMD_HELP("--multithread=n", "-M n", "Scan files with n parallel threads");
+    CMD_HELP("--split-tracks", "-T", "Split long tracks across idle threads (results may differ slightly)");
+    rsgain::print("\n");
 
     CMD_HELP("--preserve-mtimes", "-p", "Preserve file mtimes");
     CMD_HELP("--quiet",      "-q",  "Don't print scanning status messages");
@@ -20,6 +20,8 @@ enum class OutputType{
 	NONE,
 	STDOUT,
 	FILE,
+	NDJSON,
+	COLUMNAR
 };
 
 struct Config {
@@ -53,3 +55,4 @@ bool parse_target_loudness(const char *value, double &target_loudness);
 bool parse_id3v2_version(const char *value, unsigned int &version);
 bool parse_max_peak_level(const char *value, double &peak);
 std::pair<bool, bool> parse_output_mode(const std::string_view arg);
+bool parse_output_format(const char *value, OutputType &format);
@@ -30,14 +30,19 @@
  */
 
 
+#include <cmath>
 #include <mutex>
-#include <thread>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
 #include <vector>
 #include <unordered_set>
 #include <algorithm>
 #include <filesystem>
 #include <unordered_map>
 #include <stdlib.h>
+#include <string.h>
 
 #include <ebur128.h>
 extern "C" {
@@ -50,10 +55,16 @@ extern "C" {
 }
 
 #include "rsgain.hpp"
-#include "easymode.hpp"
 #include "scan.hpp"
 #include "output.hpp"
 #include "tag.hpp"
+#include "json.hpp"
+#include "sink.hpp"
+#include "dedupe.hpp"
+#include "cache.hpp"
+#include "pcm.hpp"
+#include "asyncread.hpp"
+#include "threadpool.hpp"
 
 template <typename T>
 constexpr void output_fferror(int error, T&& msg)
@@ -64,11 +75,314 @@ constexpr void output_fferror(int error, T&& msg)
 }
 #define OLD_CHANNEL_LAYOUT LIBAVUTIL_VERSION_MAJOR < 57 || (LIBAVUTIL_VERSION_MAJOR == 57 && LIBAVUTIL_VERSION_MINOR < 18)
 #define OUTPUT_FORMAT AV_SAMPLE_FMT_S16
+#define MEMORY_IO_BUFFER_SIZE 65536
+#define FAST_PROBE_SIZE 32768        // Bytes analyzed by the fast probe
+#define FAST_ANALYZE_DURATION 100000 // Microseconds
+#define SEGMENT_MIN_DURATION 300 // Seconds, shorter tracks are scanned on one thread
+#define SEGMENT_MIN_LENGTH 60    // Seconds per segment
 
-extern bool multithread;
+int quiet = 0;
+bool multithread = false;
+
+// Position in an in-memory file that is read through a custom AVIOContext
+struct MemoryInput {
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+};
+
+static int read_memory(void *opaque, uint8_t *buf, int buf_size)
+{
+    MemoryInput *input = static_cast<MemoryInput*>(opaque);
+    size_t size = std::min(static_cast<size_t>(buf_size), input->size - input->pos);
+    if (!size)
+        return AVERROR_EOF;
+    memcpy(buf, input->data + input->pos, size);
+    input->pos += size;
+    return static_cast<int>(size);
+}
+
+static int64_t seek_memory(void *opaque, int64_t offset, int whence)
+{
+    MemoryInput *input = static_cast<MemoryInput*>(opaque);
+    int64_t pos;
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE:
+            return static_cast<int64_t>(input->size);
+        case SEEK_SET:
+            pos = offset;
+            break;
+        case SEEK_CUR:
+            pos = static_cast<int64_t>(input->pos) + offset;
+            break;
+        case SEEK_END:
+            pos = static_cast<int64_t>(input->size) + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+    if (pos < 0 || pos > static_cast<int64_t>(input->size))
+        return AVERROR(EINVAL);
+    input->pos = static_cast<size_t>(pos);
+    return pos;
+}
+
+static int read_async(void *opaque, uint8_t *buf, int buf_size)
+{
+    int size = static_cast<AsyncReader*>(opaque)->read(buf, static_cast<size_t>(buf_size));
+    if (!size)
+        return AVERROR_EOF;
+    return size < 0 ? AVERROR(-size) : size;
+}
+
+static int64_t seek_async(void *opaque, int64_t offset, int whence)
+{
+    AsyncReader *reader = static_cast<AsyncReader*>(opaque);
+    int64_t pos;
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE:
+            return reader->size();
+        case SEEK_SET:
+            pos = offset;
+            break;
+        case SEEK_CUR:
+            pos = reader->position() + offset;
+            break;
+        case SEEK_END:
+            pos = reader->size() + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+    if (!reader->seek(pos))
+        return AVERROR(EINVAL);
+    return pos;
+}
+
+// av_read_frame(), and the time it took
+static int read_frame(AVFormatContext *format_ctx, AVPacket *packet, ScanCounters *counters)
+{
+    if (!counters)
+        return av_read_frame(format_ctx, packet);
+    auto start = std::chrono::steady_clock::now();
+    int rc = av_read_frame(format_ctx, packet);
+    counters->read_wait_ns.fetch_add((uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+    return rc;
+}
+
+// Convert the decoded samples to OUTPUT_FORMAT
+static int init_swr(SwrContext **swr, AVCodecContext *codec_ctx)
+{
+#if OLD_CHANNEL_LAYOUT
+    if (!codec_ctx->channel_layout)
+        codec_ctx->channel_layout = av_get_default_channel_layout(codec_ctx->channels);
+    *swr = swr_alloc_set_opts(nullptr,
+              codec_ctx->channel_layout,
+              OUTPUT_FORMAT,
+              codec_ctx->sample_rate,
+              codec_ctx->channel_layout,
+              codec_ctx->sample_fmt,
+              codec_ctx->sample_rate,
+              0,
+              nullptr
+          );
+#else
+    swr_alloc_set_opts2(swr,
+        &codec_ctx->ch_layout,
+        OUTPUT_FORMAT,
+        codec_ctx->sample_rate,
+        &codec_ctx->ch_layout,
+        codec_ctx->sample_fmt,
+        codec_ctx->sample_rate,
+        0,
+        nullptr
+    );
+#endif
+    if (!*swr)
+        return AVERROR(ENOMEM);
+    return swr_init(*swr);
+}
+
+// The meter takes the common sample formats as they are decoded, without
+// converting them to 16 bit first. Each combination of sample format and
+// channel count has its own kernel, which is chosen once per track, so the
+// loops have no branches on the format and planar audio is interleaved with
+// a fixed channel count. Other formats are converted with libswresample
+using IngestFunc = bool (*)(ebur128_state *ebur128, const AVFrame *frame, size_t offset, size_t count, std::vector<uint8_t> &buffer);
+
+static int add_frames(ebur128_state *ebur128, const short *samples, size_t frames) { return ebur128_add_frames_short(ebur128, samples, frames); }
+static int add_frames(ebur128_state *ebur128, const int *samples, size_t frames) { return ebur128_add_frames_int(ebur128, samples, frames); }
+static int add_frames(ebur128_state *ebur128, const float *samples, size_t frames) { return ebur128_add_frames_float(ebur128, samples, frames); }
+static int add_frames(ebur128_state *ebur128, const double *samples, size_t frames) { return ebur128_add_frames_double(ebur128, samples, frames); }
+
+template <typename T>
+static bool ingest_interleaved(ebur128_state *ebur128, const AVFrame *frame, size_t offset, size_t count, std::vector<uint8_t>&)
+{
+    const T *samples = reinterpret_cast<const T*>(frame->extended_data[0]) + offset * ebur128->channels;
+    return add_frames(ebur128, samples, count) == EBUR128_SUCCESS;
+}
+
+// NB_CHANNELS of 0 is any number of channels
+template <typename T, unsigned int NB_CHANNELS>
+static bool ingest_planar(ebur128_state *ebur128, const AVFrame *frame, size_t offset, size_t count, std::vector<uint8_t> &buffer)
+{
+    const unsigned int nb_channels = NB_CHANNELS ? NB_CHANNELS : ebur128->channels;
+    buffer.resize(count * nb_channels * sizeof(T));
+    T *out = reinterpret_cast<T*>(buffer.data());
+    for (unsigned int c = 0; c < nb_channels; c++) {
+        const T *in = reinterpret_cast<const T*>(frame->extended_data[c]) + offset;
+        for (size_t i = 0; i < count; i++)
+            out[i * nb_channels + c] = in[i];
+    }
+    return add_frames(ebur128, out, count) == EBUR128_SUCCESS;
+}
+
+template <typename T>
+static IngestFunc planar_ingest(int nb_channels)
+{
+    switch (nb_channels) {
+        case 1:
+            return ingest_interleaved<T>;
+        case 2:
+            return ingest_planar<T, 2>;
+        case 6:
+            return ingest_planar<T, 6>;
+        default:
+            return ingest_planar<T, 0>;
+    }
+}
+
+static IngestFunc select_ingest(AVSampleFormat format, int nb_channels)
+{
+    switch (format) {
+        case AV_SAMPLE_FMT_S16:
+            return ingest_interleaved<short>;
+        case AV_SAMPLE_FMT_S32:
+            return ingest_interleaved<int>;
+        case AV_SAMPLE_FMT_FLT:
+            return ingest_interleaved<float>;
+        case AV_SAMPLE_FMT_DBL:
+            return ingest_interleaved<double>;
+        case AV_SAMPLE_FMT_S16P:
+            return planar_ingest<short>(nb_channels);
+        case AV_SAMPLE_FMT_S32P:
+            return planar_ingest<int>(nb_channels);
+        case AV_SAMPLE_FMT_FLTP:
+            return planar_ingest<float>(nb_channels);
+        case AV_SAMPLE_FMT_DBLP:
+            return planar_ingest<double>(nb_channels);
+        default:
+            return nullptr;
+    }
+}
+
+// Open a track from its path, or from memory if it was given a buffer
+// Files are read with io_uring where it's available, and by FFmpeg otherwise
+static int open_input(AVFormatContext **format_ctx, AVIOContext **avio, MemoryInput &memory, AsyncReader &reader, const ScanJob::Track &track)
+{
+    bool async = !track.buffer && reader.open(track.path);
+    if (!track.buffer && !async)
+        return avformat_open_input(format_ctx, rsgain::format("file:{}", track.path.string()).c_str(), nullptr, nullptr);
+
+    unsigned char *io_buffer = static_cast<unsigned char*>(av_malloc(MEMORY_IO_BUFFER_SIZE));
+    if (!io_buffer)
+        return AVERROR(ENOMEM);
+    if (async)
+        *avio = avio_alloc_context(io_buffer, MEMORY_IO_BUFFER_SIZE, 0, &reader, read_async, nullptr, seek_async);
+    else {
+        memory = {track.buffer, track.buffer_size, 0};
+        *avio = avio_alloc_context(io_buffer, MEMORY_IO_BUFFER_SIZE, 0, &memory, read_memory, nullptr, seek_memory);
+    }
+    *format_ctx = avformat_alloc_context();
+    if (!*avio || !*format_ctx) {
+        if (!*avio)
+            av_free(io_buffer);
+        avformat_free_context(*format_ctx);
+        *format_ctx = nullptr;
+        return AVERROR(ENOMEM);
+    }
+    (*format_ctx)->pb = *avio;
+    (*format_ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
+    return avformat_open_input(format_ctx, async ? track.path.string().c_str() : nullptr, nullptr, nullptr);
+}
+
+// The headers of these formats describe the audio completely
+static bool fast_probe(FileType type)
+{
+    switch (type) {
+        case FileType::FLAC:
+        case FileType::WAV:
+        case FileType::OPUS:
+        case FileType::WAVPACK:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool has_audio_params(AVFormatContext *format_ctx)
+{
+    int stream_id = av_find_best_stream(format_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    if (stream_id < 0)
+        return false;
+    const AVCodecParameters *codecpar = format_ctx->streams[stream_id]->codecpar;
+#if OLD_CHANNEL_LAYOUT
+    int nb_channels = codecpar->channels;
+#else
+    int nb_channels = codecpar->ch_layout.nb_channels;
+#endif
+    return codecpar->codec_id != AV_CODEC_ID_NONE && codecpar->sample_rate > 0 && nb_channels > 0;
+}
+
+static void close_input(AVFormatContext **format_ctx, AVIOContext **avio)
+{
+    if (*format_ctx)
+        avformat_close_input(format_ctx);
+    if (*avio) {
+        av_freep(&(*avio)->buffer);
+        avio_context_free(avio);
+    }
+}
+
+// Open a track and find the parameters of its streams. For the formats of
+// fast_probe(), only the start of the file is analyzed. If that doesn't find
+// the parameters of the audio, the file is opened again for the full analysis
+static int probe_input(AVFormatContext **format_ctx, AVIOContext **avio, MemoryInput &memory, AsyncReader &reader, const ScanJob::Track &track, ScanCounters *counters)
+{
+    bool fast = fast_probe(track.type);
+    int rc;
+    while ((rc = open_input(format_ctx, avio, memory, reader, track)) >= 0) {
+        if (fast) {
+            (*format_ctx)->probesize = FAST_PROBE_SIZE;
+            (*format_ctx)->max_analyze_duration = FAST_ANALYZE_DURATION;
+        }
+        rc = avformat_find_stream_info(*format_ctx, nullptr);
+        if (counters && (*format_ctx)->pb)
+            counters->probe_bytes.fetch_add(static_cast<uint64_t>((*format_ctx)->pb->bytes_read), std::memory_order_relaxed);
+        if (!fast || (rc >= 0 && has_audio_params(*format_ctx)))
+            break;
+        close_input(format_ctx, avio);
+        fast = false;
+        if (counters)
+            counters->probe_fallbacks.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (counters)
+        counters->probes.fetch_add(1, std::memory_order_relaxed);
+    return rc;
+}
+
+// Only the packets of the selected stream are demuxed, e.g. not the cover
+// art or video of MP4 and Matroska files
+static void discard_streams(AVFormatContext *format_ctx, int stream_id)
+{
+    for (unsigned int i = 0; i < format_ctx->nb_streams; i++) {
+        if ((int) i != stream_id)
+            format_ctx->streams[i]->discard = AVDISCARD_ALL;
+    }
+}
 
 // A function to determine a file type
-static FileType determine_filetype(const std::string &extension)
+FileType determine_filetype(const std::string &extension)
 {
     static const std::unordered_map<std::string, FileType> map =  {
         {".mp2",  FileType::MP2},
@@ -102,44 +416,25 @@ static FileType determine_filetype(const std::string &extension)
     return it == map.end() ? FileType::INVALID : it->second;
 }
 
-ScanJob* ScanJob::factory(const std::filesystem::path &path)
+ScanJob* ScanJob::factory(char **files, size_t nb_files, const Config &config)
 {
-    std::unordered_set<FileType> extensions;
-    FileType file_type;
-    std::vector<Track> tracks;
-
-    for (const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator(path)) {
-        if (entry.is_regular_file() && entry.path().has_extension()
-        && ((file_type = determine_filetype(entry.path().extension().string())) != FileType::INVALID)
-        && !(file_type == FileType::M4A && get_config(file_type).skip_mp4 && entry.path().extension().string() == ".mp4")
-        && !(entry.path().filename().string().starts_with("._"))) {
-            tracks.emplace_back(entry.path(), file_type);
-            extensions.insert(file_type);
-        }
-    }
-    if (tracks.empty())
-        return nullptr;
-    file_type = extensions.size() > 1 ? FileType::DEFAULT : *extensions.begin();
-    const Config &config = get_config(file_type);
-    if (config.tag_mode == 'n')
-        return nullptr;
-    return new ScanJob(path, tracks, config, file_type);
+    return factory(std::vector<std::string>(files, files + nb_files), config);
 }
 
-ScanJob* ScanJob::factory(char **files, size_t nb_files, const Config &config)
+ScanJob* ScanJob::factory(const std::vector<std::string> &files, const Config &config)
 {
     FileType file_type;
     std::filesystem::path path;
     std::vector<Track> tracks;
     std::unordered_set<FileType> types;
-    for (size_t i = 0; i < nb_files; i++) {
-        path = files[i];
+    for (const std::string &file : files) {
+        path = file;
         if (!std::filesystem::exists(path)) {
             output_error("File '{}' does not exist", path.string());
             return nullptr;
         }
         else if ((file_type = determine_filetype(path.extension().string())) == FileType::INVALID) {
-            output_error("File '{}' is not of a supported type", files[i]);
+            output_error("File '{}' is not of a supported type", file);
             return nullptr;
         }
         else {
@@ -158,54 +453,611 @@ void free_ebur128(ebur128_state *ebur128_state)
         ebur128_destroy(&ebur128_state);
 }
 
-bool ScanJob::scan(std::mutex *ffmpeg_mutex)
+bool ScanJob::scan(std::mutex *ffmpeg_mutex, ScanCounters *counters)
 {
-    if (config.tag_mode != 'd') {
-        if (config.skip_existing) {
-            std::vector<int> existing;
-            for (auto track = tracks.rbegin(); track != tracks.rend(); ++track) {
-                if (tag_exists(*track))
-                    existing.push_back((int) (tracks.rend() - track - 1));
+    if (!analyze(ffmpeg_mutex, counters))
+        return !error;
+    tag_tracks(!multithread);
+    return true;
+}
+
+// Everything scan() does except writing the tags. Returns true if the tags
+// should be written, false if the job was skipped or failed
+bool ScanJob::analyze(std::mutex *ffmpeg_mutex, ScanCounters *counters)
+{
+    // Files that aren't scanned count as done for the progress
+    size_t nb_tracks = tracks.size();
+    uint64_t size = total_size();
+    if (!filter_existing()) {
+        if (counters)
+            counters->add_done(nb_tracks, size);
+        return false;
+    }
+    if (counters)
+        counters->add_done(nb_tracks - tracks.size(), size - total_size());
+
+    if (needs_scan()) {
+        lookup_cache();
+        std::vector<ScanReturn> results;
+        for (size_t i = 0; i < tracks.size(); i++) {
+            results.push_back(scan_track(i, ffmpeg_mutex, counters));
+            if (results.back() == ScanReturn::ERR)
+                break;
+        }
+        if (counters) {
+            for (size_t i = results.size(); i < tracks.size(); i++)
+                counters->add_done(1, tracks[i].size);
+        }
+        if (!finish_scan(results))
+            return false;
+    }
+    else if (counters)
+        counters->add_done(tracks.size(), total_size());
+    return true;
+}
+
+// Remove the tracks that already have ReplayGain information with --skip-existing.
+// Returns false if the whole job was skipped
+bool ScanJob::filter_existing()
+{
+    if (config.tag_mode == 'd' || !config.skip_existing)
+        return true;
+
+    std::vector<int> existing;
+    for (auto track = tracks.rbegin(); track != tracks.rend(); ++track) {
+        if (tag_exists(*track))
+            existing.push_back((int) (tracks.rend() - track - 1));
+    }
+    size_t nb_exists = existing.size();
+    if (nb_exists) {
+        if (nb_exists == tracks.size()) {
+            nb_files = 0;
+            skipped = nb_exists;
+            return false;
+        }
+        else if (!config.do_album) {
+            for (int i : existing) {
+                tracks.erase(tracks.begin() + i);
+                skipped++;
+                nb_files--;
             }
-            size_t nb_exists = existing.size();
-            if (nb_exists) {
-                if (nb_exists == tracks.size()) {
-                    nb_files = 0;
-                    skipped = nb_exists;
-                    return true;
+        }
+    }
+    return true;
+}
+
+ScanReturn ScanJob::scan_track(size_t index, std::mutex *ffmpeg_mutex, ScanCounters *counters)
+{
+    Track &track = tracks[index];
+    if (track.cached) {
+        if (config.preserve_mtimes)
+            track.mtime = std::make_unique<std::filesystem::file_time_type>(std::filesystem::last_write_time(track.path));
+        if (!quiet && !multithread)
+            output_ok("Using cached result for '{}'", track.path.string());
+        if (counters)
+            counters->add_done(1, track.size);
+        return ScanReturn::SUCCESS;
+    }
+    auto start = std::chrono::steady_clock::now();
+    ScanReturn ret;
+    if (!pool || max_segments < 2 || !track.scan_segments(config, ffmpeg_mutex, counters, max_segments, *pool, ret))
+        ret = track.scan(config, ffmpeg_mutex, counters, dedupe);
+    track.scan_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (counters)
+        counters->add_done(1, track.size);
+    return ret;
+}
+
+uint64_t ScanJob::total_size() const
+{
+    uint64_t size = 0;
+    for (const Track &track : tracks)
+        size += track.size;
+    return size;
+}
+
+// Process the results of scan_track() for each track, which may have been
+// obtained in parallel, and calculate the album loudness
+bool ScanJob::finish_scan(const std::vector<ScanReturn> &results)
+{
+    std::vector<size_t> remove;
+    for (size_t i = 0; i < results.size(); i++) {
+        if (results[i] == ScanReturn::ERR) {
+            error = true;
+            error_file = tracks[i].path;
+            return false;
+        }
+        else if (results[i] == ScanReturn::NO_STREAM)
+            remove.push_back(i);
+    }
+    for (auto it = remove.rbegin(); it != remove.rend(); ++it) {
+        tracks.erase(tracks.begin() + *it);
+        nb_files--;
+    }
+    calculate_loudness();
+    store_cache();
+    return true;
+}
+
+// The formats with an MD5 of their audio. The name is part of the keys of the
+// LoudnessCache, since the MD5 isn't always of the decoded samples. The codec
+// and container are reported for a cached track, which isn't opened by FFmpeg
+struct CacheFormat {
+    const char *name;
+    AVCodecID codec_id;
+    const char *container;
+};
+
+static CacheFormat cache_format(FileType type)
+{
+    switch (type) {
+        case FileType::FLAC:
+            return {"flac", AV_CODEC_ID_FLAC, "flac"};
+        case FileType::WAVPACK:
+            return {"wavpack", AV_CODEC_ID_WAVPACK, "wv"};
+        case FileType::APE:
+            return {"ape", AV_CODEC_ID_APE, "ape"};
+        default:
+            return {"", AV_CODEC_ID_NONE, ""};
+    }
+}
+
+// The album is identified by the keys of its tracks, in any order
+static std::string album_cache_key(const std::vector<std::string> &track_keys)
+{
+    std::vector<std::string> keys = track_keys;
+    std::sort(keys.begin(), keys.end());
+    XXH64 hasher;
+    for (const std::string &key : keys) {
+        if (key.empty())
+            return {};
+        hasher.update(key.data(), key.size() + 1);
+    }
+    return rsgain::format("album:{:016x}:{}", hasher.digest(), keys.size());
+}
+
+// Use the results of previous runs for the tracks whose audio MD5 is in the
+// cache. The album loudness needs the loudness states of all tracks, so unless
+// the album is in the cache too, all of its tracks are scanned
+void ScanJob::lookup_cache()
+{
+    cached_album_loudness.reset();
+    if (!cache)
+        return;
+
+    std::vector<std::string> keys;
+    bool all_cached = true;
+    for (Track &track : tracks) {
+        LoudnessCache::Entry entry;
+        CacheFormat format = cache_format(track.type);
+        std::string md5 = get_audio_md5(track);
+        track.cache_key = md5.empty() ? std::string() : rsgain::format("{}:{}:{}{}",
+            format.name,
+            md5,
+            config.true_peak ? "true" : "sample",
+            config.dual_mono ? ":dual_mono" : ""
+        );
+        track.cached = !track.cache_key.empty() && cache->find(track.cache_key, entry);
+        if (track.cached) {
+            track.result.track_loudness = entry.loudness;
+            track.result.track_peak = entry.peak;
+            track.codec_id = format.codec_id;
+            track.container = format.container;
+        }
+        all_cached &= track.cached;
+        keys.push_back(track.cache_key);
+    }
+    if (config.do_album && !config.album_as_aes77) {
+        LoudnessCache::Entry entry;
+        if (all_cached && cache->find(album_cache_key(keys), entry))
+            cached_album_loudness = entry.loudness;
+        else {
+            for (Track &track : tracks)
+                track.cached = false;
+        }
+    }
+    cache->add_hits((size_t) std::count_if(tracks.begin(), tracks.end(), [](const Track &track) { return track.cached; }));
+}
+
+// Add the results of the tracks that were decoded to the cache
+void ScanJob::store_cache()
+{
+    if (!cache)
+        return;
+    std::vector<std::string> keys;
+    for (const Track &track : tracks) {
+        if (!track.cached && !track.cache_key.empty())
+            cache->insert(track.cache_key, {track.result.track_loudness, track.result.track_peak});
+        keys.push_back(track.cache_key);
+    }
+    if (config.do_album && !config.album_as_aes77 && !cached_album_loudness && !tracks.empty()) {
+        std::string key = album_cache_key(keys);
+        if (!key.empty())
+            cache->insert(key, {tracks[0].result.album_loudness, tracks[0].result.album_peak});
+    }
+    cache->flush();
+}
+
+// Identifies the parameters of an audio stream, or 0 if its length is unknown
+static uint64_t stream_fingerprint(const AVStream *stream, int mode)
+{
+    const AVCodecParameters *par = stream->codecpar;
+    if (stream->duration == AV_NOPTS_VALUE || stream->duration <= 0)
+        return 0;
+    int64_t values[] = {
+        par->codec_id,
+        par->sample_rate,
+#if OLD_CHANNEL_LAYOUT
+        par->channels,
+#else
+        par->ch_layout.nb_channels,
+#endif
+        stream->duration,
+        stream->time_base.num,
+        stream->time_base.den,
+        mode
+    };
+    XXH64 hasher;
+    hasher.update(values, sizeof(values));
+    if (par->extradata)
+        hasher.update(par->extradata, (size_t) par->extradata_size);
+    uint64_t fingerprint = hasher.digest();
+    return fingerprint ? fingerprint : 1;
+}
+
+// Hash of the packets of the audio stream, which doesn't include the tags
+static uint64_t hash_packets(AVFormatContext *format_ctx, int stream_id, ScanCounters *counters)
+{
+    XXH64 hasher;
+    AVPacket *packet = av_packet_alloc();
+    if (!packet)
+        return 0;
+    while (read_frame(format_ctx, packet, counters) == 0) {
+        if (packet->stream_index == stream_id)
+            hasher.update(packet->data, (size_t) packet->size);
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+    if (counters && format_ctx->pb)
+        counters->bytes.fetch_add(static_cast<uint64_t>(format_ctx->pb->bytes_read), std::memory_order_relaxed);
+    return hasher.digest();
+}
+
+static AVCodecID pcm_codec_id(const PCMReader &pcm)
+{
+    if (pcm.encoding == PCMReader::Encoding::DSD)
+        return pcm.big_endian ? AV_CODEC_ID_DSD_MSBF_PLANAR : AV_CODEC_ID_DSD_LSBF_PLANAR;
+    switch (pcm.bits_per_sample) {
+        case 8:
+            return pcm.encoding == PCMReader::Encoding::UNSIGNED ? AV_CODEC_ID_PCM_U8 : AV_CODEC_ID_PCM_S8;
+        case 16:
+            return pcm.big_endian ? AV_CODEC_ID_PCM_S16BE : AV_CODEC_ID_PCM_S16LE;
+        case 24:
+            return pcm.big_endian ? AV_CODEC_ID_PCM_S24BE : AV_CODEC_ID_PCM_S24LE;
+        case 32:
+            if (pcm.encoding == PCMReader::Encoding::FLOAT)
+                return pcm.big_endian ? AV_CODEC_ID_PCM_F32BE : AV_CODEC_ID_PCM_F32LE;
+            return pcm.big_endian ? AV_CODEC_ID_PCM_S32BE : AV_CODEC_ID_PCM_S32LE;
+        default:
+            return pcm.big_endian ? AV_CODEC_ID_PCM_F64BE : AV_CODEC_ID_PCM_F64LE;
+    }
+}
+
+// Meter an uncompressed file from its memory mapping, or the frames from start
+// to end of it. Unlike the decoders, the samples are metered at the precision
+// they are stored in
+static ScanReturn scan_pcm(PCMReader &pcm, const Config &config, ScanCounters *counters, ProgressBar *progress_bar, ebur128_state *&ebur128, uint64_t start = 0, uint64_t end = UINT64_MAX)
+{
+    int peak_mode = config.true_peak ? EBUR128_MODE_TRUE_PEAK : EBUR128_MODE_SAMPLE_PEAK;
+    ebur128 = ebur128_init(pcm.channels, pcm.sample_rate, EBUR128_MODE_I | peak_mode);
+    if (!ebur128) {
+        if (!multithread)
+            output_error("Could not initialize libebur128 scanner");
+        return ScanReturn::ERR;
+    }
+    if (pcm.channels == 1 && config.dual_mono)
+        ebur128_set_channel(ebur128, 0, EBUR128_DUAL_MONO);
+
+    if (progress_bar)
+        progress_bar->begin(0, (int) std::round((double) pcm.nb_frames / (double) pcm.sample_rate));
+    pcm.seek(start, end);
+    const void *samples;
+    size_t frames;
+    while ((samples = pcm.read(frames))) {
+        switch (pcm.sample_type) {
+            case PCMReader::SampleType::SHORT:
+                ebur128_add_frames_short(ebur128, static_cast<const short*>(samples), frames);
+                break;
+            case PCMReader::SampleType::INT:
+                ebur128_add_frames_int(ebur128, static_cast<const int*>(samples), frames);
+                break;
+            case PCMReader::SampleType::FLOAT:
+                ebur128_add_frames_float(ebur128, static_cast<const float*>(samples), frames);
+                break;
+            case PCMReader::SampleType::DOUBLE:
+                ebur128_add_frames_double(ebur128, static_cast<const double*>(samples), frames);
+                break;
+        }
+        if (counters) {
+            counters->bytes.fetch_add((uint64_t) (frames * pcm.frame_size()), std::memory_order_relaxed);
+            counters->audio_ns.fetch_add((uint64_t) frames * 1000000000 / pcm.sample_rate, std::memory_order_relaxed);
+        }
+        if (progress_bar)
+            progress_bar->update((int) std::round((double) pcm.position() / (double) pcm.sample_rate));
+    }
+    if (progress_bar)
+        progress_bar->complete();
+    return ScanReturn::SUCCESS;
+}
+
+// A part of a long file that is scanned on its own thread
+struct Segment {
+    int64_t start; // In samples
+    int64_t end;
+    ebur128_state *ebur128 = nullptr;
+    ScanReturn ret = ScanReturn::ERR;
+    double seconds = 0.0;
+};
+
+// Decode the samples from first to segment.end with FFmpeg, and meter them
+static ScanReturn decode_segment(const ScanJob::Track &track, const Config &config, std::mutex *m, Segment &segment, int64_t first, ScanCounters *counters)
+{
+    int stream_id, nb_channels, sample_rate;
+    int peak_mode = config.true_peak ? EBUR128_MODE_TRUE_PEAK : EBUR128_MODE_SAMPLE_PEAK;
+    int64_t position = first;
+    int64_t bytes_read = 0;
+    uint8_t *swr_out_data[1] = {nullptr};
+    ScanReturn ret = ScanReturn::ERR;
+    std::unique_lock<std::mutex> lk;
+    IngestFunc ingest = nullptr;
+    std::vector<uint8_t> ingest_buffer;
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+    const
+#endif
+    AVCodec *codec = nullptr;
+    AVFormatContext *format_ctx = nullptr;
+    AVIOContext *avio = nullptr;
+    AVCodecContext *codec_ctx = nullptr;
+    SwrContext *swr = nullptr;
+    AVPacket *packet = nullptr;
+    AVFrame *frame = nullptr;
+    MemoryInput memory = {};
+    AsyncReader reader;
+    const AVStream *stream = nullptr;
+    if (m)
+        lk = std::unique_lock<std::mutex>(*m);
+
+    if (probe_input(&format_ctx, &avio, memory, reader, track, counters) < 0
+    || (stream_id = av_find_best_stream(format_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0)) < 0)
+        goto end;
+    discard_streams(format_ctx, stream_id);
+    stream = format_ctx->streams[stream_id];
+    if (!(codec_ctx = avcodec_alloc_context3(codec))
+    || avcodec_parameters_to_context(codec_ctx, stream->codecpar) < 0
+    || avcodec_open2(codec_ctx, codec, nullptr) < 0)
+        goto end;
+#if OLD_CHANNEL_LAYOUT
+    nb_channels = codec_ctx->channels;
+#else
+    nb_channels = codec_ctx->ch_layout.nb_channels;
+#endif
+    if (!(ingest = select_ingest(codec_ctx->sample_fmt, nb_channels)) && init_swr(&swr, codec_ctx) < 0)
+        goto end;
+    if (lk)
+        lk.unlock();
+    sample_rate = codec_ctx->sample_rate;
+
+    // Seek to the frame that contains the first sample
+    if (first && av_seek_frame(format_ctx, stream_id, av_rescale_q(first, {1, sample_rate}, stream->time_base), AVSEEK_FLAG_BACKWARD) < 0)
+        goto end;
+    if (!(segment.ebur128 = ebur128_init((unsigned int) nb_channels, (size_t) sample_rate, EBUR128_MODE_I | peak_mode))
+    || !(packet = av_packet_alloc())
+    || !(frame = av_frame_alloc()))
+        goto end;
+    if (nb_channels == 1 && config.dual_mono)
+        ebur128_set_channel(segment.ebur128, 0, EBUR128_DUAL_MONO);
+
+    // Only the samples in the segment are metered, the decoded frames are
+    // placed by their timestamps
+    while (position < segment.end && read_frame(format_ctx, packet, counters) == 0) {
+        if (counters && format_ctx->pb) {
+            counters->bytes.fetch_add(static_cast<uint64_t>(format_ctx->pb->bytes_read - bytes_read), std::memory_order_relaxed);
+            bytes_read = format_ctx->pb->bytes_read;
+        }
+        if (packet->stream_index == stream_id && avcodec_send_packet(codec_ctx, packet) == 0) {
+            while (avcodec_receive_frame(codec_ctx, frame) >= 0) {
+                if (frame->pts == AV_NOPTS_VALUE) {
+                    av_frame_unref(frame);
+                    av_packet_unref(packet);
+                    goto end;
+                }
+                int64_t pts = av_rescale_q(frame->pts, stream->time_base, {1, sample_rate});
+                int64_t skip = std::max<int64_t>(position - pts, 0);
+                int64_t count = std::min<int64_t>(frame->nb_samples, segment.end - pts) - skip;
+                if (pts > position) { // A gap would shift the blocks
+                    av_frame_unref(frame);
+                    av_packet_unref(packet);
+                    goto end;
                 }
-                else if (!config.do_album) {
-                    for (int i : existing) {
-                        tracks.erase(tracks.begin() + i);
-                        skipped++;
-                        nb_files--;
+                if (count > 0 && ingest) {
+                    if (!ingest(segment.ebur128, frame, (size_t) skip, (size_t) count, ingest_buffer)) {
+                        av_frame_unref(frame);
+                        av_packet_unref(packet);
+                        goto end;
                     }
                 }
+                else if (count > 0) {
+                    swr_out_data[0] = (uint8_t*) av_malloc(static_cast<size_t>(av_samples_get_buffer_size(nullptr, nb_channels, frame->nb_samples, OUTPUT_FORMAT, 0)));
+                    if (!swr_out_data[0] || swr_convert(swr, swr_out_data, frame->nb_samples, (const uint8_t**) frame->data, frame->nb_samples) < 0) {
+                        av_free(swr_out_data[0]);
+                        av_frame_unref(frame);
+                        av_packet_unref(packet);
+                        goto end;
+                    }
+                    ebur128_add_frames_short(segment.ebur128, (const short*) swr_out_data[0] + skip * nb_channels, static_cast<size_t>(count));
+                    av_freep(&swr_out_data[0]);
+                }
+                if (count > 0) {
+                    if (counters && position >= segment.start)
+                        counters->audio_ns.fetch_add((uint64_t) count * 1000000000 / (uint64_t) sample_rate, std::memory_order_relaxed);
+                    position += count;
+                }
+                av_frame_unref(frame);
             }
         }
-        ScanReturn ret;
-        std::vector<size_t> remove;
-        for (Track &track : tracks) {
-            ret = track.scan(config, ffmpeg_mutex);
-            if (ret == ScanReturn::ERR) {
-                error = true;
-                return false;
+        av_packet_unref(packet);
+    }
+    if (counters && format_ctx->pb)
+        counters->bytes.fetch_add(static_cast<uint64_t>(format_ctx->pb->bytes_read - bytes_read), std::memory_order_relaxed);
+
+    // Only the last segment may end early, at the end of the file
+    if (position >= segment.end || segment.end == INT64_MAX)
+        ret = ScanReturn::SUCCESS;
+
+end:
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    if (codec_ctx)
+        avcodec_free_context(&codec_ctx);
+    close_input(&format_ctx, &avio);
+    if (swr)
+        swr_free(&swr);
+    return ret;
+}
+
+// Scan a long file in nb_segments parts on the threads of pool. Each segment is metered
+// by its own ebur128 state, which is also fed the 300 ms before the segment.
+// The gating blocks are 400 ms long and start every 100 ms, so with segments
+// that start at a multiple of 100 ms, the segments have the same blocks as a
+// sequential scan, each in exactly one state. ebur128_loudness_global_multiple()
+// then gates the blocks of all states together. The K-weighting filter of each
+// state starts at the beginning of the 300 ms, so only the first block of each
+// segment is measured with a filter that hasn't settled yet. Returns false if
+// the file isn't split, and should be scanned as a whole
+bool ScanJob::Track::scan_segments(const Config &config, std::mutex *m, ScanCounters *counters, size_t nb_segments, ThreadPool &pool, ScanReturn &ret)
+{
+    int64_t nb_samples = 0;
+    int sample_rate = 0;
+    bool native = false;
+    if (buffer || (type != FileType::FLAC && type != FileType::WAVPACK && type != FileType::WAV && type != FileType::AIFF && type != FileType::DSF))
+        return false;
+
+    // Find the length of the file
+    PCMReader probe;
+    if ((type == FileType::WAV || type == FileType::AIFF || type == FileType::DSF) && probe.open(path)) {
+        native = true;
+        nb_samples = (int64_t) probe.nb_frames;
+        sample_rate = (int) probe.sample_rate;
+        container = probe.format_name();
+        codec_id = pcm_codec_id(probe);
+    }
+    else {
+        AVFormatContext *format_ctx = nullptr;
+        AVIOContext *avio = nullptr;
+        MemoryInput memory = {};
+        AsyncReader reader;
+        std::unique_lock<std::mutex> lk;
+        if (m)
+            lk = std::unique_lock<std::mutex>(*m);
+        if (probe_input(&format_ctx, &avio, memory, reader, *this, nullptr) >= 0) {
+            int stream_id = av_find_best_stream(format_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+            const AVStream *stream = stream_id >= 0 ? format_ctx->streams[stream_id] : nullptr;
+            if (stream && stream->duration != AV_NOPTS_VALUE && stream->codecpar->sample_rate > 0) {
+                sample_rate = stream->codecpar->sample_rate;
+                nb_samples = av_rescale_q(stream->duration, stream->time_base, {1, sample_rate});
+                container = format_ctx->iformat->name;
+                codec_id = stream->codecpar->codec_id;
             }
-            else if (ret == ScanReturn::NO_STREAM)
-                remove.push_back(&track - &tracks[0]);
         }
-        for (auto it = remove.rbegin(); it != remove.rend(); ++it) {
-            tracks.erase(tracks.begin() + *it);
-            nb_files--;
+        close_input(&format_ctx, &avio);
+    }
+    if (!sample_rate)
+        return false;
+    double duration = (double) nb_samples / (double) sample_rate;
+    nb_segments = std::min(nb_segments, (size_t) (duration / SEGMENT_MIN_LENGTH));
+    if (duration < SEGMENT_MIN_DURATION || nb_segments < 2)
+        return false;
+
+    // Gating blocks are a multiple of the 100 ms of libebur128
+    int64_t step = (sample_rate + 5) / 10;
+    int64_t preroll = 3 * step;
+    std::vector<Segment> segments(nb_segments);
+    for (size_t i = 0; i < nb_segments; i++) {
+        segments[i].start = i ? segments[i - 1].end : 0;
+        segments[i].end = i + 1 < nb_segments ? nb_samples * (int64_t) (i + 1) / (int64_t) nb_segments / step * step : INT64_MAX;
+    }
+
+    auto scan_segment = [&](Segment &segment) {
+        auto start = std::chrono::steady_clock::now();
+        int64_t first = std::max<int64_t>(segment.start - preroll, 0);
+        if (native) {
+            PCMReader pcm;
+            if (pcm.open(path))
+                segment.ret = scan_pcm(pcm, config, counters, nullptr, segment.ebur128, (uint64_t) first, segment.end == INT64_MAX ? UINT64_MAX : (uint64_t) segment.end);
         }
-        calculate_loudness();
+        else
+            segment.ret = decode_segment(*this, config, m, segment, first, counters);
+        segment.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    if (config.preserve_mtimes) {
+        mtime = std::make_unique<std::filesystem::file_time_type>();
+        *mtime = std::filesystem::last_write_time(path);
     }
+    // The segments are claimed in order by this thread and by tasks on the pool,
+    // so they only run on threads of the pool that are free. This thread never
+    // waits for a task that hasn't started, so the pool can't deadlock. Tasks
+    // that start after all segments were claimed only touch the shared state
+    struct State {
+        std::atomic<size_t> next = 0;
+        std::atomic<size_t> remaining;
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+    auto state = std::make_shared<State>();
+    state->remaining = nb_segments;
+    auto claim = [state, &segments, &scan_segment, nb_segments]{
+        size_t i;
+        while ((i = state->next.fetch_add(1)) < nb_segments) {
+            scan_segment(segments[i]);
+            if (state->remaining.fetch_sub(1) == 1) {
+                std::scoped_lock lock(state->mutex);
+                state->cv.notify_all();
+            }
+        }
+    };
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 1; i < nb_segments; i++)
+        pool.submit(claim);
+    claim();
+    {
+        std::unique_lock lock(state->mutex);
+        state->cv.wait(lock, [&state]{ return !state->remaining; });
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-    tag_tracks();
+    ret = ScanReturn::SUCCESS;
+    double total = 0.0;
+    for (Segment &segment : segments) {
+        if (segment.ret != ScanReturn::SUCCESS)
+            ret = ScanReturn::ERR;
+        total += segment.seconds;
+    }
+    if (ret != ScanReturn::SUCCESS) {
+        for (Segment &segment : segments) {
+            if (segment.ebur128)
+                free_ebur128(segment.ebur128);
+        }
+        return false;
+    }
+    ebur128 = std::shared_ptr<ebur128_state>(segments[0].ebur128, free_ebur128);
+    for (size_t i = 1; i < nb_segments; i++)
+        segment_states.emplace_back(segments[i].ebur128, free_ebur128);
+    this->nb_segments = nb_segments;
+    speedup = seconds > 0.0 ? total / seconds : 1.0;
     return true;
 }
 
-ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
+ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m, ScanCounters *counters, DedupeCache *dedupe)
 {
     ProgressBar progress_bar;
     int rc, stream_id = -1;
@@ -218,6 +1070,16 @@ ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
     std::unique_lock<std::mutex> *lk = nullptr;
     ebur128_state *ebur128 = nullptr;
     int nb_channels;
+    int64_t bytes_read = 0;
+    int mode = (config.true_peak ? 1 : 0) | (config.dual_mono ? 2 : 0);
+    uint64_t fingerprint = 0;
+    uint64_t hash = 0;
+    bool hashing = false;
+    XXH64 hasher;
+    DedupeCache::Entry entry;
+    PCMReader pcm;
+    IngestFunc ingest = nullptr;
+    std::vector<uint8_t> ingest_buffer;
 
 #if LIBAVCODEC_VERSION_MAJOR >= 59 
     const 
@@ -228,8 +1090,11 @@ ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
     AVFrame *frame = nullptr;
     SwrContext *swr = nullptr;
     AVFormatContext *format_ctx = nullptr;
+    AVIOContext *avio = nullptr;
+    MemoryInput memory = {};
+    AsyncReader reader;
     const AVStream *stream = nullptr;
-    if (config.preserve_mtimes) {
+    if (config.preserve_mtimes && !buffer) {
         mtime = std::make_unique<std::filesystem::file_time_type>();
         *mtime = std::filesystem::last_write_time(path);
     }
@@ -237,7 +1102,7 @@ ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
     // For Opus files, FFmpeg always adjusts the decoded audio samples by the header output
     // gain with no way to disable. To get the actual loudness of the audio signal,
     // we need to set the header output gain to 0 dB before decoding
-    if (type == FileType::OPUS && config.tag_mode != 's')
+    if (type == FileType::OPUS && config.tag_mode != 's' && !buffer)
         set_opus_header_gain(path.string().c_str(), 0);
     
     if (m)
@@ -245,25 +1110,48 @@ ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
     if (output_progress)
         output_ok("Scanning '{}'", path.string());
 
+    // Another name of a file that has been decoded already
+    if (dedupe && !buffer && dedupe->find_file(path, mode, entry))
+        goto reuse;
+
+    // Uncompressed WAV, AIFF and DSF files don't need FFmpeg, the meter reads
+    // them straight from a memory mapping
+    if ((type == FileType::WAV || type == FileType::AIFF || type == FileType::DSF) && !buffer && pcm.open(path)) {
+        container = pcm.format_name();
+        codec_id = pcm_codec_id(pcm);
+        if (output_progress && pcm.encoding == PCMReader::Encoding::DSD) {
+            output_ok("Stream: {}, {:L} Hz decimated to {:L} Hz, {} ch",
+                avcodec_get_name((AVCodecID) codec_id),
+                pcm.dsd_rate,
+                pcm.sample_rate,
+                pcm.channels
+            );
+        }
+        else if (output_progress) {
+            output_ok("Stream: {}, {} bit{}, {:L} Hz, {} ch",
+                avcodec_get_name((AVCodecID) codec_id),
+                pcm.bits_per_sample,
+                pcm.encoding == PCMReader::Encoding::FLOAT ? " float" : "",
+                pcm.sample_rate,
+                pcm.channels
+            );
+        }
+        ret = scan_pcm(pcm, config, counters, output_progress ? &progress_bar : nullptr, ebur128);
+        goto end;
+    }
+
     if (lk)
         lk->lock();
-    rc = avformat_open_input(&format_ctx, rsgain::format("file:{}", path.string()).c_str(), nullptr, nullptr);
+    rc = probe_input(&format_ctx, &avio, memory, reader, *this, counters);
     if (rc < 0) {
         if (!multithread)
-            output_fferror(rc, "Could not open input");
+            output_fferror(rc, format_ctx ? "Could not find stream info" : "Could not open input");
         goto end;
     }
 
     container = format_ctx->iformat->name;
     if (output_progress)
-        output_ok("Container: {} [{}]", format_ctx->iformat->long_name, format_ctx->iformat->name);
-
-    rc = avformat_find_stream_info(format_ctx, nullptr);
-    if (rc < 0) {
-        if (!multithread)
-            output_fferror(rc, "Could not find stream info");
-        goto end;
-    }
+        output_ok("Container: {} [{}], {:L} bytes probed", format_ctx->iformat->long_name, format_ctx->iformat->name, format_ctx->pb ? format_ctx->pb->bytes_read : 0);
 
     // Select the best audio stream
     stream_id = av_find_best_stream(format_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0);
@@ -273,9 +1161,43 @@ ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
         ret = ScanReturn::NO_STREAM;
         goto end;
     }
+    discard_streams(format_ctx, stream_id);
     stream = format_ctx->streams[stream_id];
     time_base = av_q2d(stream->time_base);
 
+    // A file with the same stream parameters as one that has been decoded before
+    // is probably a copy with different tags. Its packets are hashed first, and
+    // it's only decoded if the hash is new. Other files are hashed while they are
+    // decoded. Opus is excluded, since FFmpeg applies the output gain of the header
+    if (dedupe && !buffer && type != FileType::OPUS && (fingerprint = stream_fingerprint(stream, mode))) {
+        if (dedupe->is_candidate(fingerprint)) {
+            if (lk)
+                lk->unlock();
+            hash = hash_packets(format_ctx, stream_id, counters);
+            if (dedupe->find_content(fingerprint, hash, entry))
+                goto reuse;
+
+            // Start over to decode the file
+            if (lk)
+                lk->lock();
+            close_input(&format_ctx, &avio);
+            if ((rc = probe_input(&format_ctx, &avio, memory, reader, *this, counters)) < 0) {
+                if (!multithread)
+                    output_fferror(rc, "Could not reopen input");
+                goto end;
+            }
+            if ((stream_id = av_find_best_stream(format_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0)) < 0) {
+                ret = ScanReturn::NO_STREAM;
+                goto end;
+            }
+            discard_streams(format_ctx, stream_id);
+            stream = format_ctx->streams[stream_id];
+            time_base = av_q2d(stream->time_base);
+        }
+        else
+            hashing = true;
+    }
+
     // Initialize the decoder
     do {
         codec_ctx = avcodec_alloc_context3(codec);
@@ -329,44 +1251,11 @@ ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
         );
 
     // Only initialize swresample if we need to convert the format
-    if (codec_ctx->sample_fmt != OUTPUT_FORMAT) {
-#if OLD_CHANNEL_LAYOUT
-        if (!codec_ctx->channel_layout)
-            codec_ctx->channel_layout = av_get_default_channel_layout(codec_ctx->channels);
-        swr = swr_alloc_set_opts(nullptr,
-                 codec_ctx->channel_layout,
-                 OUTPUT_FORMAT,
-                 codec_ctx->sample_rate,
-                 codec_ctx->channel_layout,
-                 codec_ctx->sample_fmt,
-                 codec_ctx->sample_rate,
-                 0,
-                 nullptr
-             );
-#else
-        swr_alloc_set_opts2(&swr,
-            &codec_ctx->ch_layout,
-            OUTPUT_FORMAT,
-            codec_ctx->sample_rate,
-            &codec_ctx->ch_layout,
-            codec_ctx->sample_fmt,
-            codec_ctx->sample_rate,
-            0,
-            nullptr
-        );
-#endif
-        if (!swr) {
-            if (!multithread)
-                output_error("Could not allocate libswresample context");
-            goto end;
-        }
-
-        rc = swr_init(swr);
-        if (rc < 0) {
-            if (!multithread)
-                output_fferror(rc, "Could not open libswresample context");
-            goto end;
-        }
+    ingest = select_ingest(codec_ctx->sample_fmt, nb_channels);
+    if (!ingest && (rc = init_swr(&swr, codec_ctx)) < 0) {
+        if (!multithread)
+            output_fferror(rc, "Could not open libswresample context");
+        goto end;
     }
 
     if (lk)
@@ -418,8 +1307,14 @@ ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
         }
     }
     
-    while (av_read_frame(format_ctx, packet) == 0) {
+    while (read_frame(format_ctx, packet, counters) == 0) {
+        if (counters && format_ctx->pb) {
+            counters->bytes.fetch_add(static_cast<uint64_t>(format_ctx->pb->bytes_read - bytes_read), std::memory_order_relaxed);
+            bytes_read = format_ctx->pb->bytes_read;
+        }
         if (packet->stream_index == stream_id) {
+            if (hashing)
+                hasher.update(packet->data, (size_t) packet->size);
             if ((rc = avcodec_send_packet(codec_ctx, packet)) == 0) {
                 while ((rc = avcodec_receive_frame(codec_ctx, frame)) >= 0) {
 #if OLD_CHANNEL_LAYOUT
@@ -427,8 +1322,16 @@ ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
 #else
                     if (frame->ch_layout.nb_channels == nb_channels) {
 #endif
-                        // Convert audio format with libswresample if necessary
-                        if (swr) {
+                        if (ingest) {
+                            if (!ingest(ebur128, frame, 0, static_cast<size_t>(frame->nb_samples), ingest_buffer)) {
+                                if (!multithread)
+                                    output_error("Could not measure audio frame");
+                                goto end;
+                            }
+                        }
+
+                        // Convert other formats with libswresample
+                        else {
                             size_t out_size = static_cast<size_t>(
                                 av_samples_get_buffer_size(nullptr,
                                     nb_channels,
@@ -449,10 +1352,8 @@ ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
                             av_free(swr_out_data[0]);
                         }
 
-                        // Audio is already in correct format
-                        else
-                            ebur128_add_frames_short(ebur128, (short*) frame->data[0], static_cast<size_t>(frame->nb_samples));
-
+                        if (counters)
+                            counters->audio_ns.fetch_add((uint64_t) frame->nb_samples * 1000000000 / (uint64_t) codec_ctx->sample_rate, std::memory_order_relaxed);
                         if (output_progress) {
                             int pos = (int) std::round((double) frame->pts * time_base);
                             if (pos >= 0)
@@ -466,24 +1367,41 @@ ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
         av_packet_unref(packet);
     }
 
+    if (counters && format_ctx->pb)
+        counters->bytes.fetch_add(static_cast<uint64_t>(format_ctx->pb->bytes_read - bytes_read), std::memory_order_relaxed);
+
     // Make sure the progress bar finishes at 100%
     if (output_progress)
         progress_bar.complete();
+    if (hashing)
+        hash = hasher.digest();
 
     ret = ScanReturn::SUCCESS;
+    goto end;
+
+reuse:
+    this->ebur128 = entry.ebur128;
+    codec_id = entry.codec_id;
+    container = entry.container;
+    if (output_progress)
+        output_ok("Same audio as a file that was scanned before, reusing its result");
+    ret = ScanReturn::SUCCESS;
+
 end:
     av_packet_free(&packet);
     av_frame_free(&frame);
     if (codec_ctx)
         avcodec_free_context(&codec_ctx);
-    if (format_ctx)
-        avformat_close_input(&format_ctx);
+    close_input(&format_ctx, &avio);
     if (swr)
         swr_free(&swr);
 
     // Use a smart pointer to manage the remaining lifetime of the ebur128 state
-    if (ebur128) 
-        this->ebur128 = std::unique_ptr<ebur128_state, decltype(&free_ebur128)>(ebur128, free_ebur128);
+    if (ebur128) {
+        this->ebur128 = std::shared_ptr<ebur128_state>(ebur128, free_ebur128);
+        if (dedupe && !buffer && ret == ScanReturn::SUCCESS)
+            dedupe->insert(path, mode, fingerprint, hash, {this->ebur128, codec_id, container});
+    }
     
     delete lk;
     return ret;
@@ -540,20 +1458,43 @@ void ScanJob::calculate_loudness()
     }
 }
 
-void ScanJob::tag_tracks()
+// One line of --output-format=ndjson
+static std::string ndjson_record(const char *type, const std::filesystem::path &path, double loudness, double gain, double peak, bool true_peak, bool clip, size_t nb_tracks = 0)
+{
+    return rsgain::format("{{\"type\":\"{}\",\"path\":{},{}\"loudness\":{},\"gain\":{},\"peak\":{},\"peak_type\":\"{}\",\"clip_adjusted\":{}}}\n",
+        type,
+        json::escape(path.string()),
+        nb_tracks ? rsgain::format("\"tracks\":{},", nb_tracks) : "",
+        json::number(loudness),
+        json::number(gain),
+        json::number(peak),
+        true_peak ? "true" : "sample",
+        clip
+    );
+}
+
+void ScanJob::tag_tracks(bool print_results)
 {
     if (tracks.empty())
         return;
+    auto start = std::chrono::steady_clock::now();
     std::FILE *stream = nullptr;
-    if (config.tab_output != OutputType::NONE) {
+    if (config.tab_output == OutputType::FILE || config.tab_output == OutputType::STDOUT) {
+
+        // All jobs of a run share one table on stdout, e.g. the groups of --files-from
+        static bool stdout_header = false;
+        bool header = true;
         if (config.tab_output == OutputType::FILE) {
             std::filesystem::path output_file = path / "replaygain.csv";
             stream = fopen(output_file.string().c_str(), "wb");
         }
-        else
+        else {
             stream = stdout;
+            header = !stdout_header;
+            stdout_header = true;
+        }
 
-        if (stream) {
+        if (stream && header) {
             if (config.sep_header)
                 fputs("sep=\t\n", stream);
             fputs("Filename\tLoudness (LUFS)\tGain (dB)\tPeak\t Peak (dB)\tPeak Type\tClipping Adjustment?\n", stream);
@@ -561,13 +1502,19 @@ void ScanJob::tag_tracks()
     }
 
     // Tag the files
-    bool tab_output = config.tab_output != OutputType::NONE && stream != nullptr;
-    bool human_output = !multithread && !quiet && config.tag_mode != 'd';
+    bool tab_output = stream != nullptr;
+    bool sink_output = (config.tab_output == OutputType::NDJSON || config.tab_output == OutputType::COLUMNAR) && result_sink.is_open() && needs_scan();
+    std::string records;
+    std::vector<ResultRow> rows;
+    bool human_output = print_results && !quiet && config.tag_mode != 'd';
     if (config.sort_alphanum)
         std::sort(tracks.begin(), tracks.end(), [](const auto &a, const auto &b){ return a.path.string() < b.path.string(); });
     for (Track &track : tracks) {
-        if (config.tag_mode != 's')
-            error |= !tag_track(track, config);
+        if (config.tag_mode != 's') {
+            bool tagged = tag_track(track, config);
+            error |= !tagged;
+            tag_writes += tagged;
+        }
 
         if (tab_output) {
             // Filename;Loudness;Gain (dB);Peak;Peak (dB);Peak Type;Clipping Adjustment;
@@ -589,6 +1536,29 @@ void ScanJob::tag_tracks()
             }
         } 
         
+        if (sink_output && config.tab_output == OutputType::COLUMNAR) {
+            rows.push_back({
+                .path = track.path.string(),
+                .codec = avcodec_get_name((AVCodecID) track.codec_id),
+                .container = track.container,
+                .track_loudness = track.result.track_loudness,
+                .track_gain = track.result.track_gain,
+                .track_peak = track.result.track_peak,
+                .album_loudness = config.do_album ? track.result.album_loudness : NAN,
+                .album_gain = config.do_album ? track.result.album_gain : NAN,
+                .album_peak = config.do_album ? track.result.album_peak : NAN,
+                .scan_time = track.scan_time,
+                .flags = (uint8_t) ((config.true_peak ? ROW_TRUE_PEAK : 0) | (track.tclip ? ROW_TRACK_CLIP : 0)
+                    | (track.aclip ? ROW_ALBUM_CLIP : 0) | (config.do_album ? ROW_ALBUM : 0))
+            });
+        }
+        else if (sink_output) {
+            records += ndjson_record("track", track.path, track.result.track_loudness, track.result.track_gain, track.result.track_peak, config.true_peak, track.tclip);
+            if (config.do_album && ((size_t) (&track - &tracks[0]) == (nb_files - 1))) {
+                records += ndjson_record("album", path.empty() ? track.path.parent_path() : path, track.result.album_loudness, track.result.album_gain, track.result.album_peak, config.true_peak, track.aclip, nb_files);
+            }
+        }
+
         // Human-readable output
         if (human_output) {
             rsgain::print("\nTrack: {}\n", track.path.string());
@@ -602,6 +1572,8 @@ void ScanJob::tag_tracks()
                 track.type == FileType::OPUS && (config.opus_mode == 'r' || config.opus_mode == 's') ? rsgain::format("({})", GAIN_TO_Q78(track.result.track_gain)) : "",
                 track.tclip ? " (adjusted to prevent clipping)" : ""
             );
+            if (track.nb_segments > 1)
+                rsgain::print("  Segments: {}, {:.1f}x speedup\n", track.nb_segments, track.speedup);
 
             if (config.do_album && ((size_t) (&track - &tracks[0]) == (nb_files - 1))) {
                 rsgain::print("\nAlbum:\n");
@@ -621,6 +1593,11 @@ void ScanJob::tag_tracks()
     }
     if (config.tab_output == OutputType::FILE && stream != nullptr)
         fclose(stream);
+    if (!records.empty())
+        result_sink.push(std::move(records));
+    if (!rows.empty())
+        result_sink.push(std::move(rows));
+    tag_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 }
 
 void ScanJob::update_data(ScanData &data)
@@ -656,8 +1633,13 @@ void ScanJob::Track::calculate_loudness(const Config &config)
     unsigned int channel = 0;
     double track_loudness, track_peak;
 
-    if (ebur128_loudness_global(ebur128.get(), &track_loudness) != EBUR128_SUCCESS)
-        track_loudness = config.target_loudness;
+    if (cached)
+        track_loudness = result.track_loudness;
+    else {
+        std::vector<ebur128_state*> all = states();
+        if (ebur128_loudness_global_multiple(all.data(), all.size(), &track_loudness) != EBUR128_SUCCESS)
+            track_loudness = config.target_loudness;
+    }
 
     // Edge case for completely silent tracks
     if (track_loudness == -HUGE_VAL) {
@@ -667,11 +1649,22 @@ void ScanJob::Track::calculate_loudness(const Config &config)
     }
 
     else {
-        std::vector<double> peaks(ebur128->channels);
-        int (*get_peak)(ebur128_state*, unsigned int, double*) = config.true_peak ? ebur128_true_peak : ebur128_sample_peak;
-        for (double &pk : peaks)
-            get_peak(ebur128.get(), channel++, &pk);
-        track_peak = *std::max_element(peaks.begin(), peaks.end());
+        if (cached)
+            track_peak = result.track_peak;
+        else {
+            std::vector<double> peaks(ebur128->channels);
+            int (*get_peak)(ebur128_state*, unsigned int, double*) = config.true_peak ? ebur128_true_peak : ebur128_sample_peak;
+            for (double &pk : peaks) {
+                pk = 0.0;
+                for (ebur128_state *state : states()) {
+                    double segment_peak;
+                    if (get_peak(state, channel, &segment_peak) == EBUR128_SUCCESS)
+                        pk = std::max(pk, segment_peak);
+                }
+                channel++;
+            }
+            track_peak = *std::max_element(peaks.begin(), peaks.end());
+        }
 
         result.track_gain = (type == FileType::OPUS && config.opus_mode == 's' ? -23.0 : config.target_loudness)
                              - track_loudness;
@@ -680,6 +1673,15 @@ void ScanJob::Track::calculate_loudness(const Config &config)
     }
 }
 
+// The states of all segments of the track
+std::vector<ebur128_state*> ScanJob::Track::states() const
+{
+    std::vector<ebur128_state*> all = {ebur128.get()};
+    for (const auto &state : segment_states)
+        all.push_back(state.get());
+    return all;
+}
+
 void ScanJob::calculate_album_loudness() 
 {
     double album_loudness, album_peak;
@@ -696,12 +1698,21 @@ void ScanJob::calculate_album_loudness()
         }
     }
 
+    else if (cached_album_loudness) {
+        album_loudness = *cached_album_loudness;
+        album_peak = std::max_element(tracks.begin(),
+                         tracks.end(),
+                         [](const auto &a, const auto &b) { return a.result.track_peak < b.result.track_peak; }
+                     )->result.track_peak;
+    }
+
     else {
         std::vector<ebur128_state*> states;
         states.reserve(tracks.size());
         for (const Track &track : tracks)
             if (track.result.track_loudness != -HUGE_VAL)
-                states.emplace_back(track.ebur128.get());
+                for (ebur128_state *state : track.states())
+                    states.emplace_back(state);
 
         if (ebur128_loudness_global_multiple(states.data(), states.size(), &album_loudness) != EBUR128_SUCCESS)
             album_loudness = config.target_loudness;
@@ -1,11 +1,19 @@
 #pragma once
 
 #include <mutex>
+#include <atomic>
+#include <memory>
 #include <vector>
+#include <optional>
 #include <filesystem>
 #include <ebur128.h>
 
+struct Directory;
+class DedupeCache;
+class LoudnessCache;
+class ThreadPool;
 void free_ebur128(ebur128_state *ebur128);
+extern bool multithread;
 
 enum class FileType {
     INVALID = -1,
@@ -30,6 +38,8 @@ enum class FileType {
 #endif
 };
 
+FileType determine_filetype(const std::string &extension);
+
 struct ScanResult {
 	double track_gain;
 	double track_peak;
@@ -58,23 +68,52 @@ struct ScanData {
     std::vector<std::string> error_directories;
 };
 
+// Running totals that are updated by the workers while they are scanning
+struct ScanCounters {
+    std::atomic<uint64_t> bytes = 0;     // Read from the files
+    std::atomic<uint64_t> audio_ns = 0;  // Duration of the decoded audio
+    std::atomic<uint64_t> read_wait_ns = 0; // Spent in av_read_frame(), mostly waiting for reads
+    std::atomic<uint64_t> probes = 0;
+    std::atomic<uint64_t> probe_bytes = 0;     // Read to find the stream parameters
+    std::atomic<uint64_t> probe_fallbacks = 0; // Fast probes that needed the full analysis
+    std::atomic<uint64_t> files = 0;     // Finished or skipped
+    std::atomic<uint64_t> size_done = 0; // File size of those files
+
+    void add_done(uint64_t nb_files, uint64_t size)
+    {
+        files.fetch_add(nb_files, std::memory_order_relaxed);
+        size_done.fetch_add(size, std::memory_order_relaxed);
+    }
+};
+
 
 class ScanJob {
 	public:
 		struct Track {
 			std::filesystem::path path;
 			FileType type;
-			std::unique_ptr<ebur128_state, decltype(&free_ebur128)> ebur128;
+			std::shared_ptr<ebur128_state> ebur128; // Shared by copies of the same audio with DedupeCache
 			std::unique_ptr<std::filesystem::file_time_type> mtime;
 			std::string container;
 			ScanResult result;
 			int codec_id;
 			bool tclip = false;
 			bool aclip = false;
+			const uint8_t *buffer = nullptr; // Scan from memory instead of path
+			size_t buffer_size = 0;
+			double scan_time = 0.0; // Seconds
+			uint64_t size = 0; // File size, if known
+			std::string cache_key; // Empty if the file has no MD5 of its audio
+			bool cached = false; // The loudness and peak are from the LoudnessCache
+			std::vector<std::shared_ptr<ebur128_state>> segment_states; // Of the segments after the first, which is in ebur128
+			size_t nb_segments = 1;
+			double speedup = 0.0; // Of the segments over a sequential scan
 
-			Track(const std::filesystem::path &path, FileType type) : path(path), type(type), ebur128(nullptr, free_ebur128) {};
-			ScanReturn scan(const Config &config, std::mutex *ffmpeg_mutex);
+			Track(const std::filesystem::path &path, FileType type) : path(path), type(type) {};
+			ScanReturn scan(const Config &config, std::mutex *ffmpeg_mutex, ScanCounters *counters = nullptr, DedupeCache *dedupe = nullptr);
+			bool scan_segments(const Config &config, std::mutex *ffmpeg_mutex, ScanCounters *counters, size_t nb_segments, ThreadPool &pool, ScanReturn &ret);
 			void calculate_loudness(const Config &config);
+			std::vector<ebur128_state*> states() const;
 		};
 
 		std::filesystem::path path;
@@ -84,18 +123,40 @@ class ScanJob {
 		bool error = false;
 		size_t clipping_adjustments = 0;
 		size_t skipped = 0;
+		size_t device = 0;
+		DedupeCache *dedupe = nullptr;
+		LoudnessCache *cache = nullptr;
+		size_t max_segments = 1;     // Segments that a long track can be split into
+		ThreadPool *pool = nullptr;  // Scans the segments, none if tracks aren't split
+		std::filesystem::path error_file;
+		double tag_time = 0.0; // Seconds spent in tag_tracks()
+		size_t tag_writes = 0;
 
 		ScanJob(const std::filesystem::path &path, std::vector<Track> &tracks, const Config &config, FileType &type) : path(path), nb_files(tracks.size()), config(config), type(type), tracks(std::move(tracks)) {}
 		ScanJob(std::vector<Track> &tracks, const Config &config, FileType type) : nb_files(tracks.size()), config(config), type(type), tracks(std::move(tracks)) {}
 		static ScanJob* factory(char **files, size_t nb_files, const Config &config);
-		static ScanJob* factory(const std::filesystem::path &path);
-		bool scan(std::mutex *ffmpeg_mutex = nullptr);
+		static ScanJob* factory(const std::vector<std::string> &files, const Config &config);
+		static ScanJob* factory(Directory &directory);
+		bool scan(std::mutex *ffmpeg_mutex = nullptr, ScanCounters *counters = nullptr);
+		bool analyze(std::mutex *ffmpeg_mutex = nullptr, ScanCounters *counters = nullptr);
 		void update_data(ScanData &data);
 
+		// The steps of scan(), for callers that scan the tracks of a job in parallel
+		bool filter_existing();
+		bool needs_scan() const { return config.tag_mode != 'd'; }
+		size_t nb_tracks() const { return tracks.size(); }
+		const Track& get_track(size_t index) const { return tracks[index]; }
+		uint64_t total_size() const;
+		ScanReturn scan_track(size_t index, std::mutex *ffmpeg_mutex, ScanCounters *counters = nullptr);
+		bool finish_scan(const std::vector<ScanReturn> &results);
+		void tag_tracks(bool print_results);
+
 	private:
 		std::vector<Track> tracks;
+		std::optional<double> cached_album_loudness;
 
 		void calculate_loudness();
 		void calculate_album_loudness();
-		void tag_tracks();
+		void lookup_cache();
+		void store_cache();
 };
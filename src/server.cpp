@@ -0,0 +1,859 @@
+#include <cmath>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <filesystem>
+#include <unordered_set>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#endif
+
+#include <config.h>
+#include "rsgain.hpp"
+#include "scan.hpp"
+#include "output.hpp"
+#include "concurrency.hpp"
+#include "server.hpp"
+
+static inline void help_serve();
+
+#ifndef _WIN32
+static volatile sig_atomic_t stop_requested = 0;
+static int signal_fd = -1;
+
+static void handle_signal(int)
+{
+    stop_requested = 1;
+    char c = 0;
+    [[maybe_unused]] ssize_t rc = write(signal_fd, &c, 1);
+}
+
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1 && fcntl(fd, F_SETFD, FD_CLOEXEC) != -1;
+}
+
+static std::string error_line(const std::string *id, const std::string &message)
+{
+    return id ? rsgain::format("{{\"id\":{},\"error\":{}}}", json::escape(*id), json::escape(message))
+              : rsgain::format("{{\"error\":{}}}", json::escape(message));
+}
+
+static std::string file_line(const std::string &id, const std::string &file, const char *status, const std::string &message = "")
+{
+    return rsgain::format("{{\"id\":{},\"file\":{},\"status\":\"{}\"{}}}",
+        json::escape(id),
+        json::escape(file),
+        status,
+        message.empty() ? "" : rsgain::format(",\"message\":{}", json::escape(message))
+    );
+}
+
+// The settings of a request. They have the same meaning as the options of Custom Mode
+static bool parse_config(const json::Value &value, Config &config, std::string &error)
+{
+    static const std::pair<const char*, bool Config::*> flags[] = {
+        {"album",           &Config::do_album},
+        {"album_aes77",     &Config::album_as_aes77},
+        {"skip_existing",   &Config::skip_existing},
+        {"true_peak",       &Config::true_peak},
+        {"dual_mono",       &Config::dual_mono},
+        {"lowercase",       &Config::lowercase},
+        {"preserve_mtimes", &Config::preserve_mtimes}
+    };
+    static const std::pair<const char*, char Config::*> modes[] = {
+        {"tag_mode",  &Config::tag_mode},
+        {"clip_mode", &Config::clip_mode},
+        {"opus_mode", &Config::opus_mode}
+    };
+    static const char *valid_modes[] = {"dis", "npa", "drtas"};
+
+    if (!value.is(json::Type::OBJECT)) {
+        error = "'config' must be an object";
+        return false;
+    }
+    for (const auto &[key, setting] : value.object) {
+        auto flag = std::find_if(std::begin(flags), std::end(flags), [&](const auto &f){ return key == f.first; });
+        auto mode = std::find_if(std::begin(modes), std::end(modes), [&](const auto &m){ return key == m.first; });
+        if (flag != std::end(flags)) {
+            if (!setting.is(json::Type::BOOLEAN)) {
+                error = rsgain::format("'{}' must be true or false", key);
+                return false;
+            }
+            config.*(flag->second) = setting.boolean;
+        }
+        else if (mode != std::end(modes)) {
+            const char *valid = valid_modes[mode - std::begin(modes)];
+            if (!setting.is(json::Type::STRING) || setting.string.size() != 1 || !strchr(valid, setting.string[0])) {
+                error = rsgain::format("Invalid {} '{}'", key, setting.string);
+                return false;
+            }
+            config.*(mode->second) = setting.string[0];
+        }
+        else if (key == "loudness") {
+            if (!setting.is(json::Type::NUMBER) || setting.number < MIN_TARGET_LOUDNESS || setting.number > MAX_TARGET_LOUDNESS) {
+                error = "Invalid target loudness";
+                return false;
+            }
+            config.target_loudness = std::round(setting.number);
+        }
+        else if (key == "max_peak") {
+            if (!setting.is(json::Type::NUMBER) || setting.number > 0.0) {
+                error = "Invalid max peak level";
+                return false;
+            }
+            config.max_peak_level = setting.number;
+        }
+        else if (key == "id3v2_version") {
+            if (setting.is(json::Type::STRING) && setting.string == "keep")
+                config.id3v2version = ID3V2_KEEP;
+            else if (setting.is(json::Type::NUMBER) && (setting.number == 3.0 || setting.number == 4.0))
+                config.id3v2version = (unsigned int) setting.number;
+            else {
+                error = "Invalid ID3v2 version; only 'keep', 3, and 4 are supported";
+                return false;
+            }
+        }
+        else {
+            error = rsgain::format("Unknown setting '{}'", key);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns an empty string if the file can be scanned
+static std::string check_file(const std::string &file, const char *&status)
+{
+    std::error_code ec;
+    std::filesystem::path path(file);
+    status = "error";
+    if (!std::filesystem::is_regular_file(path, ec))
+        return "File does not exist";
+    if (determine_filetype(path.extension().string()) == FileType::INVALID) {
+        status = "unsupported";
+        return "File is not of a supported type";
+    }
+    return "";
+}
+
+Server::Server(const std::string &socket_path, size_t nb_threads, size_t max_queue, const Config &defaults, const std::string &metrics_path)
+: socket_path(socket_path), nb_threads(nb_threads), max_queue(max_queue), defaults(defaults), metrics_path(metrics_path) {}
+
+Server::~Server()
+{
+    metrics.reset();
+    pool.reset();
+    if (listen_fd != -1)
+        close(listen_fd);
+    if (bound)
+        unlink(socket_path.c_str());
+    for (int fd : wake_fds) {
+        if (fd != -1)
+            close(fd);
+    }
+}
+
+bool Server::open_socket()
+{
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        output_fail("Socket path '{}' is too long", socket_path);
+        return false;
+    }
+    memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        output_fail("Failed to create socket: {}", strerror(errno));
+        return false;
+    }
+    if (bind(listen_fd, (sockaddr*) &addr, sizeof(addr)) == -1) {
+
+        // A socket that was left behind by a server that didn't exit cleanly
+        // is replaced, but one that still accepts connections isn't
+        bool in_use = true;
+        if (errno == EADDRINUSE) {
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            in_use = fd == -1 || connect(fd, (sockaddr*) &addr, sizeof(addr)) == 0;
+            if (fd != -1)
+                close(fd);
+        }
+        if (in_use || unlink(socket_path.c_str()) == -1 || bind(listen_fd, (sockaddr*) &addr, sizeof(addr)) == -1) {
+            output_fail("Failed to bind socket '{}': {}", socket_path, in_use && errno == EADDRINUSE ? "Address in use" : strerror(errno));
+            return false;
+        }
+    }
+    bound = true;
+    if (::listen(listen_fd, SOMAXCONN) == -1 || !set_nonblocking(listen_fd)) {
+        output_fail("Failed to listen on socket '{}': {}", socket_path, strerror(errno));
+        return false;
+    }
+
+    // The workers and the signal handler wake the main thread through a pipe
+    if (pipe(wake_fds) == -1 || !set_nonblocking(wake_fds[0]) || !set_nonblocking(wake_fds[1])) {
+        output_fail("Failed to create pipe: {}", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool Server::run()
+{
+    if (!open_socket())
+        return false;
+
+    signal_fd = wake_fds[1];
+    struct sigaction action = {};
+    action.sa_handler = handle_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    multithread = true;
+    pool = std::make_unique<ThreadPool>(nb_threads);
+    if (!metrics_path.empty()) {
+        metrics = std::make_unique<Metrics>(metrics_path, counters);
+        if (!metrics->start([this](Metrics &m){ m.set_worker_time(pool->busy_time(), pool->idle_time()); }))
+            return false;
+        metrics->set_queue(0, nb_threads);
+    }
+    output_ok("Listening on '{}' with {} threads", socket_path, nb_threads);
+
+    std::vector<pollfd> fds;
+    std::vector<uint64_t> ids;
+    while (!stop_requested) {
+        fds.clear();
+        ids.clear();
+        fds.push_back({listen_fd, POLLIN, 0});
+        fds.push_back({wake_fds[0], POLLIN, 0});
+        for (const auto &[id, client] : clients) {
+            short events = 0;
+            if (!client.eof && client.queued < max_queue)
+                events |= POLLIN;
+            if (!client.output.empty())
+                events |= POLLOUT;
+            fds.push_back({client.fd, events, 0});
+            ids.push_back(id);
+        }
+
+        if (poll(fds.data(), (nfds_t) fds.size(), -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            output_fail("poll() failed: {}", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            char buffer[256];
+            while (read(wake_fds[0], buffer, sizeof(buffer)) > 0);
+            process_completions();
+        }
+        if (fds[0].revents & POLLIN)
+            accept_client();
+        for (size_t i = 0; i < ids.size(); i++) {
+            short revents = fds[i + 2].revents;
+            Client *client = find_client(ids[i]);
+            if (!revents || !client)
+                continue;
+            bool ok = true;
+            if (revents & POLLOUT)
+                ok = write_client(*client);
+            if (ok && (revents & (POLLIN | POLLHUP | POLLERR)))
+                ok = read_client(ids[i], *client) && !(client->eof && (revents & (POLLHUP | POLLERR)));
+            if (!ok)
+                close_client(ids[i]);
+        }
+        dispatch();
+
+        // A client that has stopped sending is closed once it has all its results
+        size_t queued = 0;
+        for (auto it = clients.begin(); it != clients.end();) {
+            const Client &client = it->second;
+            auto next = std::next(it);
+            queued += client.pending.size();
+            if (client.eof && !client.queued && client.requests.empty() && client.output.empty())
+                close_client(it->first);
+            it = next;
+        }
+        if (metrics)
+            metrics->set_queue(queued, nb_threads);
+    }
+
+    output_ok("Shutting down");
+    while (!clients.empty())
+        close_client(clients.begin()->first);
+    if (metrics)
+        metrics->stop();
+    pool.reset();
+    return true;
+}
+
+void Server::accept_client()
+{
+    int fd;
+    while ((fd = accept(listen_fd, nullptr, nullptr)) != -1) {
+        if (!set_nonblocking(fd)) {
+            close(fd);
+            continue;
+        }
+        Client &client = clients[++next_client];
+        client.fd = fd;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        output_error("Failed to accept connection: {}", strerror(errno));
+}
+
+Server::Client* Server::find_client(uint64_t id)
+{
+    auto it = clients.find(id);
+    return it == clients.end() ? nullptr : &it->second;
+}
+
+bool Server::read_client(uint64_t id, Client &client)
+{
+    char buffer[65536];
+    ssize_t n = read(client.fd, buffer, sizeof(buffer));
+    if (n == -1)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    if (n == 0) {
+        client.eof = true;
+        return true;
+    }
+
+    client.input.append(buffer, (size_t) n);
+    size_t start = 0, end;
+    while (!client.eof && (end = client.input.find('\n', start)) != std::string::npos) {
+        std::string line = client.input.substr(start, end - start);
+        start = end + 1;
+        if (line.find_first_not_of(" \t\r") != std::string::npos)
+            handle_line(id, client, line);
+    }
+    client.input.erase(0, start);
+
+    // Stop reading from a client that doesn't send line breaks
+    if (client.input.size() > SERVER_MAX_LINE) {
+        send(client, error_line(nullptr, "Request is too large"));
+        client.input.clear();
+        client.eof = true;
+    }
+    return true;
+}
+
+bool Server::write_client(Client &client)
+{
+    ssize_t n = write(client.fd, client.output.data(), client.output.size());
+    if (n == -1)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    client.output.erase(0, (size_t) n);
+    return true;
+}
+
+// Jobs that are being scanned finish in the background, without results
+void Server::close_client(uint64_t id)
+{
+    Client *client = find_client(id);
+    if (!client)
+        return;
+    for (auto &[request_id, request] : client->requests)
+        request->cancelled = true;
+    close(client->fd);
+    clients.erase(id);
+}
+
+void Server::send(Client &client, const std::string &line)
+{
+    client.output += line;
+    client.output += '\n';
+}
+
+void Server::handle_line(uint64_t id, Client &client, const std::string &line)
+{
+    json::Value request;
+    std::string error;
+    if (!json::parse(line, request, error)) {
+        send(client, error_line(nullptr, rsgain::format("Invalid JSON: {}", error)));
+        return;
+    }
+    if (!request.is(json::Type::OBJECT)) {
+        send(client, error_line(nullptr, "Request must be an object"));
+        return;
+    }
+
+    const json::Value *cancel_id = request.get("cancel");
+    if (cancel_id) {
+        if (cancel_id->is(json::Type::STRING))
+            cancel(client, cancel_id->string);
+        else
+            send(client, error_line(nullptr, "'cancel' must be a request id"));
+        return;
+    }
+    handle_request(id, client, request);
+}
+
+void Server::handle_request(uint64_t id, Client &client, const json::Value &value)
+{
+    const json::Value *id_value = value.get("id");
+    if (!id_value || !id_value->is(json::Type::STRING)) {
+        send(client, error_line(nullptr, "Request needs a string 'id'"));
+        return;
+    }
+    const std::string &request_id = id_value->string;
+    if (client.requests.count(request_id)) {
+        send(client, error_line(&request_id, "A request with this id is still running"));
+        return;
+    }
+
+    auto request = std::make_shared<Request>();
+    request->id = request_id;
+    request->client = id;
+    request->config = defaults;
+    std::string error;
+    const json::Value *config = value.get("config");
+    if (config && !parse_config(*config, request->config, error)) {
+        send(client, error_line(&request_id, error));
+        return;
+    }
+
+    // Each list of files is scanned as an album. Without album gain, every
+    // file is a separate job so that its result is sent as soon as it's ready
+    std::vector<const json::Value*> groups;
+    const json::Value *files = value.get("files");
+    const json::Value *albums = value.get("albums");
+    if (files && !albums && files->is(json::Type::ARRAY))
+        groups.push_back(files);
+    else if (albums && !files && albums->is(json::Type::ARRAY)) {
+        request->config.do_album = true;
+        for (const json::Value &album : albums->array)
+            groups.push_back(&album);
+    }
+    else {
+        send(client, error_line(&request_id, "Request needs either a 'files' or an 'albums' array"));
+        return;
+    }
+    for (const json::Value *group : groups) {
+        if (!group->is(json::Type::ARRAY) || !std::all_of(group->array.begin(), group->array.end(), [](const json::Value &v){ return v.is(json::Type::STRING); })) {
+            send(client, error_line(&request_id, "Files must be given as arrays of strings"));
+            return;
+        }
+    }
+
+    client.requests[request_id] = request;
+    for (const json::Value *group : groups) {
+        std::vector<std::string> valid;
+        std::vector<std::pair<std::string, const char*>> invalid;
+        for (const json::Value &file : group->array) {
+            const char *status;
+            std::string message = check_file(file.string, status);
+            if (message.empty())
+                valid.push_back(file.string);
+            else {
+                send(client, file_line(request_id, file.string, status, message));
+                invalid.emplace_back(file.string, status);
+            }
+        }
+        request->files += invalid.size();
+        request->errors += invalid.size();
+
+        // Like Custom Mode, an album with a file that can't be scanned is skipped
+        if (request->config.do_album) {
+            if (invalid.empty() && !valid.empty())
+                queue_job(client, request, valid);
+            else {
+                for (const std::string &file : valid)
+                    send(client, file_line(request_id, file, "error", "Another file of the album can't be scanned"));
+                request->files += valid.size();
+                request->errors += valid.size();
+            }
+        }
+        else {
+            for (const std::string &file : valid)
+                queue_job(client, request, {file});
+        }
+    }
+
+    if (!request->jobs) {
+        send(client, rsgain::format("{{\"id\":{},\"done\":true,\"files\":{},\"errors\":{}}}", json::escape(request_id), request->files, request->errors));
+        client.requests.erase(request_id);
+    }
+}
+
+void Server::queue_job(Client &client, const std::shared_ptr<Request> &request, const std::vector<std::string> &files)
+{
+    std::vector<ScanJob::Track> tracks;
+    std::unordered_set<FileType> types;
+    for (const std::string &file : files) {
+        std::filesystem::path path(file);
+        FileType type = determine_filetype(path.extension().string());
+        tracks.emplace_back(path, type);
+        types.insert(type);
+    }
+
+    auto job = std::make_shared<Job>();
+    job->request = request;
+    job->files = files;
+    job->scan = std::make_unique<ScanJob>(tracks, request->config, types.size() > 1 ? FileType::DEFAULT : *types.begin());
+    client.pending.push_back(std::move(job));
+    client.queued++;
+    request->jobs++;
+}
+
+void Server::cancel(Client &client, const std::string &id)
+{
+    auto it = client.requests.find(id);
+    if (it == client.requests.end()) {
+        send(client, error_line(&id, "No running request with this id"));
+        return;
+    }
+    std::shared_ptr<Request> request = std::move(it->second);
+    client.requests.erase(it);
+    request->cancelled = true;
+
+    // Tracks that are already being scanned are stopped at the end of the file
+    std::erase_if(client.pending, [&](const std::shared_ptr<Job> &job) {
+        if (job->request != request)
+            return false;
+        job->dropped = true;
+        client.queued--;
+        return true;
+    });
+    send(client, rsgain::format("{{\"id\":{},\"cancelled\":true}}", json::escape(id)));
+}
+
+// Hand out tasks until all threads are busy. The clients take turns, so a
+// large request doesn't hold up the others
+void Server::dispatch()
+{
+    while (in_flight < nb_threads) {
+        bool dispatched = false;
+        auto it = clients.upper_bound(last_client);
+        for (size_t n = 0; n < clients.size() && !dispatched; n++, ++it) {
+            if (it == clients.end())
+                it = clients.begin();
+            Client &client = it->second;
+            if (client.output.size() > SERVER_OUTPUT_LIMIT)
+                continue;
+            for (auto job = client.pending.begin(); job != client.pending.end(); ++job) {
+                if (start_task(*job)) {
+                    std::shared_ptr<Job> &j = *job;
+                    if (j->prepared && j->next_track == j->scan->nb_tracks())
+                        client.pending.erase(job);
+                    dispatched = true;
+                    last_client = it->first;
+                    break;
+                }
+            }
+        }
+        if (!dispatched)
+            break;
+    }
+}
+
+// Submit the next step of a job to the pool. Returns false if there is
+// nothing to do until the job has been prepared
+bool Server::start_task(const std::shared_ptr<Job> &job)
+{
+    if (!job->started) {
+        job->started = true;
+        job->start = std::chrono::steady_clock::now();
+        in_flight++;
+        pool->submit([this, job]{
+            ScanJob &scan = *job->scan;
+            if (job->request->cancelled)
+                complete(job, Stage::FINISHED);
+            else if (!scan.filter_existing()) {
+                job->skipped = true;
+                complete(job, Stage::FINISHED);
+            }
+            else if (!scan.needs_scan()) {
+                scan.tag_tracks(false);
+                job->scanned = true;
+                complete(job, Stage::FINISHED);
+            }
+            else {
+                job->results.resize(scan.nb_tracks(), ScanReturn::SUCCESS);
+                job->remaining = scan.nb_tracks();
+                complete(job, Stage::PREPARED);
+            }
+        });
+        return true;
+    }
+    if (!job->prepared || job->next_track == job->scan->nb_tracks())
+        return false;
+
+    // The last track of a job calculates the album loudness and writes the tags
+    size_t index = job->next_track++;
+    in_flight++;
+    pool->submit([this, job, index]{
+        bool cancelled = job->request->cancelled;
+        job->results[index] = cancelled ? ScanReturn::ERR : job->scan->scan_track(index, &ffmpeg_mutex, &counters);
+        if (job->remaining.fetch_sub(1) == 1) {
+            if (!job->request->cancelled && (job->scanned = job->scan->finish_scan(job->results)))
+                job->scan->tag_tracks(false);
+            complete(job, Stage::FINISHED);
+        }
+        else
+            complete(job, Stage::SCANNED);
+    });
+    return true;
+}
+
+// Called by the workers
+void Server::complete(std::shared_ptr<Job> job, Stage stage)
+{
+    {
+        std::scoped_lock lock(completion_mutex);
+        completions.push_back({std::move(job), stage});
+    }
+    char c = 0;
+    [[maybe_unused]] ssize_t rc = write(wake_fds[1], &c, 1);
+}
+
+void Server::process_completions()
+{
+    std::vector<Completion> list;
+    {
+        std::scoped_lock lock(completion_mutex);
+        list.swap(completions);
+    }
+
+    for (Completion &completion : list) {
+        in_flight--;
+        Job &job = *completion.job;
+        if (completion.stage == Stage::PREPARED)
+            job.prepared = true;
+        if (completion.stage != Stage::FINISHED)
+            continue;
+
+        Client *client = find_client(job.request->client);
+        if (!client || job.dropped)
+            continue;
+        std::erase(client->pending, completion.job);
+        client->queued--;
+        if (job.request->cancelled)
+            continue;
+        if (metrics)
+            metrics->record_job(*job.scan, std::chrono::duration<double>(std::chrono::steady_clock::now() - job.start).count());
+
+        report(*client, job);
+        Request &request = *job.request;
+        if (!--request.jobs) {
+            send(*client, rsgain::format("{{\"id\":{},\"done\":true,\"files\":{},\"errors\":{}}}", json::escape(request.id), request.files, request.errors));
+            client->requests.erase(request.id);
+        }
+    }
+}
+
+// Send the result of each file of a finished job
+void Server::report(Client &client, Job &job)
+{
+    Request &request = *job.request;
+    const ScanJob &scan = *job.scan;
+    const Config &config = request.config;
+    request.files += job.files.size();
+
+    if (job.skipped) {
+        for (const std::string &file : job.files)
+            send(client, file_line(request.id, file, "skipped"));
+        return;
+    }
+    if (!job.scanned || scan.error) {
+        std::string message = job.scanned ? "Could not write tags" : rsgain::format("Could not scan '{}'", scan.error_file.string());
+        for (const std::string &file : job.files)
+            send(client, file_line(request.id, file, "error", message));
+        request.errors += job.files.size();
+        return;
+    }
+
+    // Files without an audio stream were removed from the job
+    size_t index = 0;
+    for (size_t i = 0; i < job.files.size(); i++) {
+        if (i < job.results.size() && job.results[i] == ScanReturn::NO_STREAM) {
+            send(client, file_line(request.id, job.files[i], "no_audio"));
+            continue;
+        }
+        if (!scan.needs_scan()) {
+            send(client, file_line(request.id, job.files[i], "ok"));
+            continue;
+        }
+        const ScanResult &result = scan.get_track(index).result;
+        std::string line = rsgain::format("{{\"id\":{},\"file\":{},\"status\":\"ok\",\"track_gain\":{},\"track_peak\":{},\"track_loudness\":{},\"track_clip_adjusted\":{}",
+            json::escape(request.id),
+            json::escape(job.files[i]),
+            json::number(result.track_gain),
+            json::number(result.track_peak),
+            json::number(result.track_loudness),
+            scan.get_track(index).tclip
+        );
+        if (config.do_album) {
+            line += rsgain::format(",\"album_gain\":{},\"album_peak\":{},\"album_loudness\":{},\"album_clip_adjusted\":{}",
+                json::number(result.album_gain),
+                json::number(result.album_peak),
+                json::number(result.album_loudness),
+                scan.get_track(index).aclip
+            );
+        }
+        line += '}';
+        send(client, line);
+        index++;
+    }
+}
+#endif
+
+void serve(int argc, char *argv[])
+{
+#ifdef _WIN32
+    output_fail("Server mode is not supported on Windows");
+    quit(EXIT_FAILURE);
+#else
+    int rc, i;
+    const char *socket_path = nullptr;
+    const char *metrics_path = "";
+    const char *short_opts = "+hqs:m:Q:M:";
+    size_t threads = limit_workers(get_resource_limits().cpus);
+    size_t max_queue = SERVER_DEFAULT_QUEUE;
+    opterr = 0;
+
+    static struct option long_opts[] = {
+        { "help",        no_argument,       nullptr, 'h' },
+        { "quiet",       no_argument,       nullptr, 'q' },
+        { "socket",      required_argument, nullptr, 's' },
+        { "multithread", required_argument, nullptr, 'm' },
+        { "queue",       required_argument, nullptr, 'Q' },
+        { "metrics",     required_argument, nullptr, 'M' },
+        { 0, 0, 0, 0 }
+    };
+
+    // Requests bring their own settings, these are the defaults of Custom Mode
+    Config defaults = {
+        .tag_mode = 's',
+        .skip_existing = false,
+        .target_loudness = RG_TARGET_LOUDNESS,
+        .max_peak_level = 0.0,
+        .true_peak = false,
+        .clip_mode = 'n',
+        .do_album = false,
+        .album_as_aes77 = false,
+        .tab_output = OutputType::NONE,
+        .sep_header = false,
+        .sort_alphanum = false,
+        .lowercase = false,
+        .id3v2version = ID3V2_KEEP,
+        .opus_mode = 'd',
+        .skip_mp4 = false,
+        .preserve_mtimes = false,
+        .dual_mono = false
+    };
+
+    while ((rc = getopt_long(argc, argv, short_opts, long_opts, &i)) != -1) {
+        switch (rc) {
+            case 'h':
+                help_serve();
+                quit(EXIT_SUCCESS);
+                break;
+
+            case 'q':
+                quiet = true;
+                break;
+
+            case 's':
+                socket_path = optarg;
+                break;
+
+            case 'm':
+                {
+                    unsigned int max_threads = get_resource_limits().cpus;
+                    if (MATCH(optarg, "MAX") || MATCH(optarg, "max"))
+                        threads = max_threads;
+                    else {
+                        threads = (size_t) strtoul(optarg, nullptr, 10);
+                        if (threads < 1) {
+                            output_fail("Invalid multithread argument '{}'", optarg);
+                            quit(EXIT_FAILURE);
+                        }
+                        else if (threads > max_threads) {
+                            output_warn("{} threads were requested, but only {} are available", threads, max_threads);
+                            threads = max_threads;
+                        }
+                    }
+                }
+                break;
+
+            case 'Q':
+                {
+                    char *end = nullptr;
+                    max_queue = (size_t) strtoul(optarg, &end, 10);
+                    if (!max_queue || *end) {
+                        output_fail("Invalid queue length '{}'", optarg);
+                        quit(EXIT_FAILURE);
+                    }
+                }
+                break;
+
+            case 'M':
+                metrics_path = optarg;
+                break;
+
+            case '?':
+                if (optopt)
+                    output_fail("Unrecognized option '{:c}'", optopt);
+                else
+                    output_fail("Unrecognized option '{}'", argv[optind - 1] + 2);
+                quit(EXIT_FAILURE);
+                break;
+        }
+    }
+
+    if (!socket_path) {
+        output_fail("No socket path specified");
+        rsgain::print("Run '{} serve --help' for help.\n", EXECUTABLE_TITLE);
+        quit(EXIT_FAILURE);
+    }
+    if (optind < argc) {
+        output_fail("Unexpected argument '{}'", argv[optind]);
+        quit(EXIT_FAILURE);
+    }
+
+    Server server(socket_path, threads, max_queue, defaults, metrics_path);
+    if (!server.run())
+        quit(EXIT_FAILURE);
+#endif
+}
+
+static inline void help_serve() {
+    rsgain::print(COLOR_RED "Usage: " COLOR_OFF "{}{}{} serve [OPTIONS] --socket=PATH\n", COLOR_GREEN, EXECUTABLE_TITLE, COLOR_OFF);
+
+    rsgain::print("  Server Mode listens on a Unix domain socket and scans the files that clients\n");
+    rsgain::print("  send to it. Each request is a JSON object on a single line, and the results are\n");
+    rsgain::print("  sent back as JSON objects, one line per file. See the man page for the protocol.\n");
+    rsgain::print("\n");
+
+    rsgain::print(COLOR_RED "Options:\n" COLOR_OFF);
+    CMD_HELP("--help",     "-h", "Show this help");
+    CMD_HELP("--quiet",    "-q", "Don't print status messages");
+    rsgain::print("\n");
+
+    CMD_HELP("--socket=p", "-s p", "Listen on the socket at path p");
+    CMD_HELP("--multithread=n", "-m n", "Scan files with n parallel threads (default: all CPUs)");
+    CMD_HELP("--queue=n", "-Q n", "Stop reading from a client while it has n unfinished jobs (default: " STR(SERVER_DEFAULT_QUEUE) ")");
+    CMD_HELP("--metrics=p", "-M p", "Write statistics for Prometheus to file p");
+    rsgain::print("\n");
+
+    rsgain::print("Please report any issues to " PROJECT_URL "/issues\n");
+    rsgain::print("\n");
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "rsgain.hpp"
+#include "scan.hpp"
+#include "threadpool.hpp"
+#include "json.hpp"
+#include "metrics.hpp"
+
+#define SERVER_MAX_LINE       (16 << 20) // Maximum size of a request
+#define SERVER_OUTPUT_LIMIT   (1 << 20)  // Stop scanning for a client when this much output is unread
+#define SERVER_DEFAULT_QUEUE  256        // Default maximum of unfinished jobs per client
+
+void serve(int argc, char *argv[]);
+
+// Scans the requests of any number of clients that are connected to a Unix
+// domain socket. Requests and responses are JSON objects, one per line.
+// The tracks of all clients are scanned on one thread pool, and the clients
+// take turns whenever a thread becomes available
+class Server {
+    public:
+        Server(const std::string &socket_path, size_t nb_threads, size_t max_queue, const Config &defaults, const std::string &metrics_path);
+        ~Server();
+        bool run();
+
+    private:
+        struct Request {
+            std::string id;
+            uint64_t client;
+            Config config;
+            size_t jobs = 0;
+            size_t files = 0;
+            size_t errors = 0;
+            std::atomic<bool> cancelled = false;
+        };
+
+        // One album, or one file without album gain
+        struct Job {
+            std::shared_ptr<Request> request;
+            std::unique_ptr<ScanJob> scan;
+            std::vector<std::string> files;
+            std::vector<ScanReturn> results;
+            std::atomic<size_t> remaining = 0;
+            std::chrono::steady_clock::time_point start;
+            size_t next_track = 0;
+            bool started = false;
+            bool prepared = false;
+            bool scanned = false;
+            bool skipped = false;
+            bool dropped = false;
+        };
+
+        enum class Stage {
+            PREPARED,
+            SCANNED,
+            FINISHED
+        };
+
+        struct Completion {
+            std::shared_ptr<Job> job;
+            Stage stage;
+        };
+
+        struct Client {
+            int fd;
+            std::string input;
+            std::string output;
+            std::deque<std::shared_ptr<Job>> pending;
+            std::unordered_map<std::string, std::shared_ptr<Request>> requests;
+            size_t queued = 0;
+            bool eof = false;
+        };
+
+        std::string socket_path;
+        size_t nb_threads;
+        size_t max_queue;
+        Config defaults;
+        std::string metrics_path;
+        ScanCounters counters;
+        std::unique_ptr<Metrics> metrics;
+        int listen_fd = -1;
+        int wake_fds[2] = {-1, -1};
+        bool bound = false;
+        std::unique_ptr<ThreadPool> pool;
+        std::mutex ffmpeg_mutex;
+        std::mutex completion_mutex;
+        std::vector<Completion> completions;
+        std::map<uint64_t, Client> clients;
+        uint64_t next_client = 0;
+        uint64_t last_client = 0;
+        size_t in_flight = 0;
+
+        bool open_socket();
+        void accept_client();
+        bool read_client(uint64_t id, Client &client);
+        bool write_client(Client &client);
+        void close_client(uint64_t id);
+        Client* find_client(uint64_t id);
+        void handle_line(uint64_t id, Client &client, const std::string &line);
+        void handle_request(uint64_t id, Client &client, const json::Value &request);
+        void cancel(Client &client, const std::string &id);
+        void queue_job(Client &client, const std::shared_ptr<Request> &request, const std::vector<std::string> &files);
+        void dispatch();
+        bool start_task(const std::shared_ptr<Job> &job);
+        void complete(std::shared_ptr<Job> job, Stage stage);
+        void process_completions();
+        void report(Client &client, Job &job);
+        void send(Client &client, const std::string &line);
+};
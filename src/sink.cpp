@@ -0,0 +1,232 @@
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <bit>
+#include <filesystem>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "rsgain.hpp"
+#include "output.hpp"
+#include "sink.hpp"
+
+#define COLUMNAR_MAGIC   "RSGAINC\0"
+#define COLUMNAR_VERSION 1
+
+ResultSink result_sink;
+
+// The columnar format is little-endian on every platform
+template <typename T>
+static void put(std::string &out, T value)
+{
+    if constexpr (std::endian::native == std::endian::big) {
+        if constexpr (sizeof(T) == 8)
+            value = std::bit_cast<T>(__builtin_bswap64(std::bit_cast<uint64_t>(value)));
+        else if constexpr (sizeof(T) == 4)
+            value = std::bit_cast<T>(__builtin_bswap32(std::bit_cast<uint32_t>(value)));
+    }
+    char bytes[sizeof(T)];
+    memcpy(bytes, &value, sizeof(T));
+    out.append(bytes, sizeof(T));
+}
+
+// Encodes rows in the columnar format. Every column starts at a multiple of
+// 8 bytes from the start of its block
+class ColumnBlock {
+    public:
+        void add(ResultRow &&row, uint32_t job);
+        size_t size() const { return jobs.size(); }
+        void encode(std::string &out);
+
+    private:
+        std::vector<uint32_t> jobs;
+        std::vector<ResultRow> rows;
+
+        static void pad(std::string &out, size_t start);
+        void put_strings(std::string &out, size_t start, std::string ResultRow::*member);
+        void put_doubles(std::string &out, double ResultRow::*member);
+};
+
+void ColumnBlock::pad(std::string &out, size_t start)
+{
+    out.append((8 - (out.size() - start) % 8) % 8, '\0');
+}
+
+void ColumnBlock::add(ResultRow &&row, uint32_t job)
+{
+    rows.push_back(std::move(row));
+    jobs.push_back(job);
+}
+
+// Offsets into the concatenated string data, with one more entry than rows
+void ColumnBlock::put_strings(std::string &out, size_t start, std::string ResultRow::*member)
+{
+    uint32_t offset = 0;
+    put<uint32_t>(out, offset);
+    for (const ResultRow &row : rows) {
+        offset += (uint32_t) (row.*member).size();
+        put<uint32_t>(out, offset);
+    }
+    for (const ResultRow &row : rows)
+        out += row.*member;
+    pad(out, start);
+}
+
+void ColumnBlock::put_doubles(std::string &out, double ResultRow::*member)
+{
+    for (const ResultRow &row : rows)
+        put<double>(out, row.*member);
+}
+
+void ColumnBlock::encode(std::string &out)
+{
+    if (rows.empty())
+        return;
+    size_t start = out.size();
+    put<uint32_t>(out, (uint32_t) rows.size());
+    put<uint32_t>(out, 0);
+    put<uint64_t>(out, 0); // Size, filled in below
+
+    for (uint32_t job : jobs)
+        put<uint32_t>(out, job);
+    pad(out, start);
+    put_strings(out, start, &ResultRow::path);
+    put_strings(out, start, &ResultRow::codec);
+    put_strings(out, start, &ResultRow::container);
+    for (double ResultRow::*column : {&ResultRow::track_loudness, &ResultRow::track_gain, &ResultRow::track_peak,
+    &ResultRow::album_loudness, &ResultRow::album_gain, &ResultRow::album_peak, &ResultRow::scan_time})
+        put_doubles(out, column);
+    for (const ResultRow &row : rows)
+        out += (char) row.flags;
+    pad(out, start);
+
+    std::string size;
+    put<uint64_t>(size, (uint64_t) (out.size() - start - 16));
+    out.replace(start + 8, 8, size);
+    rows.clear();
+    jobs.clear();
+}
+
+ResultSink::~ResultSink()
+{
+    close();
+}
+
+// Start writing to path, or stdout if path is "-"
+bool ResultSink::open(const std::filesystem::path &path, SinkFormat format)
+{
+    if (path == "-")
+        stream = stdout;
+    else if (!(stream = fopen(path.string().c_str(), "wb"))) {
+        output_error("Could not open output file '{}'", path.string());
+        return false;
+    }
+    this->path = path;
+    this->format = format;
+    if (format == SinkFormat::COLUMNAR) {
+        std::string header(COLUMNAR_MAGIC, 8);
+        put<uint32_t>(header, COLUMNAR_VERSION);
+        put<uint32_t>(header, 0);
+        failed = fwrite(header.data(), 1, header.size(), stream) != header.size();
+    }
+    writer = std::make_unique<std::thread>(&ResultSink::write, this);
+    return true;
+}
+
+// Write the remaining records and stop the writer. Returns false if any write failed
+bool ResultSink::close()
+{
+    std::scoped_lock lock(close_mutex);
+    if (!writer)
+        return true;
+    Node *node = new Node;
+    node->last = true;
+    link(node);
+    writer->join();
+    writer.reset();
+    if (stream != stdout)
+        fclose(stream);
+    stream = nullptr;
+    if (failed)
+        output_error("Failed to write results to '{}'", path.string());
+    return !failed;
+}
+
+// Called by the workers with the records of one job, one per line
+void ResultSink::push(std::string records)
+{
+    Node *node = new Node;
+    node->records = std::move(records);
+    link(node);
+}
+
+// Called by the workers with the tracks of one job
+void ResultSink::push(std::vector<ResultRow> rows)
+{
+    Node *node = new Node;
+    node->rows = std::move(rows);
+    link(node);
+}
+
+void ResultSink::link(Node *node)
+{
+    node->next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed));
+    head.notify_one();
+}
+
+void ResultSink::write()
+{
+    std::string buffer;
+    buffer.reserve(SINK_BUFFER_SIZE);
+    ColumnBlock block;
+    uint32_t job = 0;
+    bool last = false;
+    while (!last) {
+        head.wait(nullptr, std::memory_order_acquire);
+        Node *list = head.exchange(nullptr, std::memory_order_acquire);
+
+        // The list is in reverse order of arrival
+        Node *reversed = nullptr;
+        while (list) {
+            Node *next = list->next;
+            list->next = reversed;
+            reversed = list;
+            list = next;
+        }
+
+        while (reversed) {
+            Node *node = reversed;
+            reversed = node->next;
+            last |= node->last;
+            if (format == SinkFormat::COLUMNAR) {
+
+                // A block is written once it's full, and the rest at the end
+                for (ResultRow &row : node->rows) {
+                    block.add(std::move(row), job);
+                    if (block.size() == COLUMNAR_BLOCK_ROWS)
+                        block.encode(buffer);
+                }
+                if (!node->rows.empty())
+                    job++;
+                if (node->last)
+                    block.encode(buffer);
+            }
+            else
+                buffer += node->records;
+            delete node;
+            if (buffer.size() >= SINK_BUFFER_SIZE || !reversed) {
+                if (!failed && fwrite(buffer.data(), 1, buffer.size(), stream) != buffer.size())
+                    failed = true;
+                buffer.clear();
+            }
+        }
+        if (!failed && fflush(stream))
+            failed = true;
+    }
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <filesystem>
+#include <stdint.h>
+
+#define SINK_BUFFER_SIZE   (1 << 20) // Records are written in batches of up to this size
+#define COLUMNAR_BLOCK_ROWS 16384    // Rows per block of the columnar format, see docs/COLUMNAR.md
+
+enum class SinkFormat {
+    NDJSON,
+    COLUMNAR
+};
+
+// Flags column of the columnar format
+#define ROW_TRUE_PEAK   0x01
+#define ROW_TRACK_CLIP  0x02
+#define ROW_ALBUM_CLIP  0x04
+#define ROW_ALBUM       0x08
+
+// The final result of one track
+struct ResultRow {
+    std::string path;
+    std::string codec;
+    std::string container;
+    double track_loudness;
+    double track_gain;
+    double track_peak;
+    double album_loudness;
+    double album_gain;
+    double album_peak;
+    double scan_time;
+    uint8_t flags;
+};
+
+// Collects the results of all jobs of a run into one output. The workers
+// push finished records onto a lock-free list, and a single writer thread
+// takes the whole list at once and writes it with few large writes, so the
+// output can be followed while the scan is running
+class ResultSink {
+    public:
+        ~ResultSink();
+        bool open(const std::filesystem::path &path, SinkFormat format);
+        bool close();
+        void push(std::string records);
+        void push(std::vector<ResultRow> rows);
+        bool is_open() const { return writer != nullptr; }
+
+    private:
+        struct Node {
+            std::string records;
+            std::vector<ResultRow> rows;
+            Node *next = nullptr;
+            bool last = false;
+        };
+
+        std::FILE *stream = nullptr;
+        std::filesystem::path path;
+        SinkFormat format;
+        std::unique_ptr<std::thread> writer;
+        std::atomic<Node*> head = nullptr;
+        std::atomic<bool> failed = false;
+        std::mutex close_mutex;
+
+        void link(Node *node);
+        void write();
+};
+
+extern ResultSink result_sink;
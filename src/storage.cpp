@@ -0,0 +1,220 @@
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <stdint.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <sys/vfs.h>
+#include <sys/sysmacros.h>
+#endif
+#ifdef __APPLE__
+#include <sys/param.h>
+#include <sys/mount.h>
+#endif
+
+#include "rsgain.hpp"
+#include "output.hpp"
+#include "storage.hpp"
+
+#ifdef __linux__
+// Filesystem magic numbers of network filesystems, from statfs(2)
+#define NFS_SUPER_MAGIC   0x6969
+#define SMB_SUPER_MAGIC   0x517B
+#define CIFS_SUPER_MAGIC  0xFF534D42
+#define SMB2_SUPER_MAGIC  0xFE534D42
+#define CEPH_SUPER_MAGIC  0x00C36400
+#define FUSE_SUPER_MAGIC  0x65735546
+#define AFS_SUPER_MAGIC   0x5346414F
+#define V9FS_SUPER_MAGIC  0x01021997
+#endif
+
+#ifdef __linux__
+// Location of the first extent of a file on the underlying device, as reported
+// by the FIEMAP ioctl. Filesystems that don't support FIEMAP (e.g. NFS), and
+// files without an allocated extent yet, fall back to the inode number, which
+// roughly follows allocation order on most filesystems
+uint64_t get_physical_offset(int dir_fd, const char *name, uint64_t inode)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return inode;
+
+    alignas(struct fiemap) char buffer[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = {};
+    struct fiemap *map = reinterpret_cast<struct fiemap*>(buffer);
+    map->fm_start = 0;
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+    uint64_t offset = inode;
+    if (!ioctl(fd, FS_IOC_FIEMAP, map) && map->fm_mapped_extents
+    && !(map->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC)))
+        offset = map->fm_extents[0].fe_physical;
+    close(fd);
+    return offset;
+}
+#endif
+
+uint64_t get_physical_offset([[maybe_unused]] const std::filesystem::path &path)
+{
+#if defined __linux__
+    struct stat st;
+    if (stat(path.c_str(), &st))
+        return 0;
+    return get_physical_offset(AT_FDCWD, path.c_str(), st.st_ino);
+#elif !defined _WIN32
+    struct stat st;
+    return stat(path.c_str(), &st) ? 0 : st.st_ino;
+#else
+    return 0;
+#endif
+}
+
+// The device that holds a file or directory. Returns false if it can't be determined
+bool get_device_id([[maybe_unused]] const std::filesystem::path &path, uint64_t &id)
+{
+#ifdef _WIN32
+    id = 0;
+    return false;
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st))
+        return false;
+    id = (uint64_t) st.st_dev;
+    return true;
+#endif
+}
+
+#ifdef __linux__
+// Whether the block device is a hard drive: 1 if it is, 0 if not, -1 if it has no
+// queue in sysfs. Partitions don't have a queue of their own, it's found at the
+// parent block device
+static int get_rotational(const std::string &name)
+{
+    std::filesystem::path sysfs = "/sys/dev/block/" + name;
+    for (const std::filesystem::path &queue : {sysfs / "queue", sysfs / ".." / "queue"}) {
+        std::ifstream file(queue / "rotational");
+        int rotational;
+        if (file >> rotational)
+            return rotational ? 1 : 0;
+    }
+    return -1;
+}
+
+// Undo the octal escapes of spaces, tabs, newlines and backslashes in /proc/self/mountinfo
+static std::string unescape_mount_field(const std::string &field)
+{
+    auto is_octal = [&](size_t i) { return i < field.size() && field[i] >= '0' && field[i] <= '7'; };
+    std::string s;
+    for (size_t i = 0; i < field.size(); i++) {
+        if (field[i] == '\\' && is_octal(i + 1) && is_octal(i + 2) && is_octal(i + 3)) {
+            s += (char) ((field[i + 1] - '0') * 64 + (field[i + 2] - '0') * 8 + (field[i + 3] - '0'));
+            i += 3;
+        }
+        else
+            s += field[i];
+    }
+    return s;
+}
+
+// Filesystems like btrfs report an anonymous device number (0:xx) that has no
+// block device behind it. The block device is then taken from the source of the
+// mount that holds path in /proc/self/mountinfo. Returns false if the source
+// isn't a block device, e.g. for a ZFS dataset
+static bool get_backing_device(const std::filesystem::path &path, std::string &source, std::string &name)
+{
+    std::error_code ec;
+    std::string target = std::filesystem::weakly_canonical(path, ec).string();
+    if (ec)
+        return false;
+    std::ifstream file("/proc/self/mountinfo");
+    std::string line;
+    size_t best = 0;
+    bool found = false;
+    while (std::getline(file, line)) {
+
+        // ID, parent ID, major:minor, root, mount point, options, optional fields, "-", type, source, options
+        std::istringstream fields(line);
+        std::string id, parent, number, root, mount_point, field, type, mount_source;
+        if (!(fields >> id >> parent >> number >> root >> mount_point))
+            continue;
+        while (fields >> field && field != "-");
+        if (!(fields >> type >> mount_source))
+            continue;
+        mount_point = unescape_mount_field(mount_point);
+
+        // Later mounts on the same mount point hide earlier ones
+        bool match = mount_point == "/" || target == mount_point || target.starts_with(mount_point + "/");
+        if (match && mount_point.size() >= best) {
+            best = mount_point.size();
+            source = unescape_mount_field(mount_source);
+            found = true;
+        }
+    }
+    struct stat st;
+    if (!found || !source.starts_with("/dev/") || stat(source.c_str(), &st) || !S_ISBLK(st.st_mode))
+        return false;
+    name = rsgain::format("{}:{}", major(st.st_rdev), minor(st.st_rdev));
+    return true;
+}
+#endif
+
+// Determine whether a device is a network filesystem or a spinning disk, which
+// decides how many jobs may read from it at the same time
+DeviceInfo get_device_info(uint64_t id, [[maybe_unused]] const std::filesystem::path &path)
+{
+    DeviceInfo info = {
+        .id = id,
+        .type = DeviceType::SOLID_STATE,
+        .limit = 0,
+        .name = ""
+    };
+#if defined __linux__
+    info.name = rsgain::format("{}:{}", major(id), minor(id));
+    struct statfs fs;
+    if (!statfs(path.c_str(), &fs)) {
+        switch ((unsigned long) fs.f_type) {
+            case NFS_SUPER_MAGIC:
+            case SMB_SUPER_MAGIC:
+            case CIFS_SUPER_MAGIC:
+            case SMB2_SUPER_MAGIC:
+            case CEPH_SUPER_MAGIC:
+            case FUSE_SUPER_MAGIC:
+            case AFS_SUPER_MAGIC:
+            case V9FS_SUPER_MAGIC:
+                info.type = DeviceType::REMOTE;
+                break;
+        }
+    }
+
+    if (info.type != DeviceType::REMOTE) {
+        int rotational = get_rotational(info.name);
+        std::string source, name;
+        if (rotational < 0 && get_backing_device(path, source, name)) {
+            rotational = get_rotational(name);
+            info.name = source;
+        }
+        if (rotational > 0)
+            info.type = DeviceType::ROTATIONAL;
+        info.classified = rotational >= 0;
+    }
+#elif defined __APPLE__
+    struct statfs fs;
+    if (!statfs(path.c_str(), &fs)) {
+        if (!(fs.f_flags & MNT_LOCAL))
+            info.type = DeviceType::REMOTE;
+        info.name = fs.f_mntonname;
+    }
+#endif
+    if (info.type == DeviceType::ROTATIONAL)
+        info.limit = DEVICE_LIMIT_ROTATIONAL;
+    else if (info.type == DeviceType::REMOTE)
+        info.limit = DEVICE_LIMIT_REMOTE;
+    return info;
+}
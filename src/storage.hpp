@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <filesystem>
+#include <stdint.h>
+
+// Default number of concurrent jobs per device. SSDs aren't limited
+#define DEVICE_LIMIT_ROTATIONAL 2
+#define DEVICE_LIMIT_REMOTE     4
+
+enum class DeviceType {
+    SOLID_STATE,
+    ROTATIONAL,
+    REMOTE
+};
+
+struct DeviceInfo {
+    uint64_t id;
+    DeviceType type;
+    size_t limit; // 0 for no limit
+    std::string name;
+    bool classified = true; // False if it's not known whether it's a hard drive
+};
+
+uint64_t get_physical_offset(const std::filesystem::path &path);
+#ifdef __linux__
+uint64_t get_physical_offset(int dir_fd, const char *name, uint64_t inode);
+#endif
+bool get_device_id(const std::filesystem::path &path, uint64_t &id);
+DeviceInfo get_device_info(uint64_t id, const std::filesystem::path &path);
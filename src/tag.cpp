@@ -30,8 +30,11 @@
 
 #include <cmath>
 #include <cstdio>
+#include <cstring>
 #include <string>
 #include <array>
+#include <vector>
+#include <algorithm>
 #include <memory>
 #include <bit>
 
@@ -78,6 +81,7 @@
 #define OGG_ROW_SIZE 4
 #define OPUS_HEAD_OFFSET 7 * OGG_ROW_SIZE
 #define OGG_CRC_OFFSET 5 * OGG_ROW_SIZE + 2
+#define WAVPACK_TAIL_SIZE 65536 // Searched for the block with the MD5 at the end of a WavPack file
 #define OGG_SEGMENT_TABLE_OFFSET 27
 #define OPUS_GAIN_OFFSET 11 * OGG_ROW_SIZE
 #define RG_TAGS_UPPERCASE 1
@@ -137,6 +141,8 @@ static bool tag_exists_asf(const ScanJob::Track &track);
 static bool tag_exists_matroska(const ScanJob::Track &track);
 #endif
 static int16_t get_opus_header_gain(const char* path);
+static std::string get_wavpack_md5(const char *path);
+static std::string get_ape_md5(const char *path);
 
 enum class RGTag {
     TRACK_GAIN,
@@ -343,6 +349,33 @@ bool tag_exists(const ScanJob::Track &track)
     return false;
 }
 
+// The MD5 of the audio that some lossless formats store in their headers, as a
+// hex string, or an empty string if the file doesn't have one. It's of the
+// decoded samples for FLAC and WavPack, and of the encoded stream for APE
+std::string get_audio_md5(const ScanJob::Track &track)
+{
+    TagLib::ByteVector md5;
+    switch (track.type) {
+        case FileType::FLAC:
+            {
+                TagLib::FLAC::File file(track.path.string().c_str(), true, TagLib::AudioProperties::Fast);
+                if (file.isValid() && file.audioProperties())
+                    md5 = file.audioProperties()->signature();
+            }
+            break;
+
+        case FileType::WAVPACK:
+            return get_wavpack_md5(track.path.string().c_str());
+
+        case FileType::APE:
+            return get_ape_md5(track.path.string().c_str());
+
+        default:
+            return {};
+    }
+    return md5.size() == 16 && md5 != TagLib::ByteVector(16, '\0') ? std::string(md5.toHex().data(), md5.size() * 2) : std::string();
+}
+
 template<typename T>
 static bool tag_exists_id3(const ScanJob::Track &track)
 {
@@ -918,6 +951,98 @@ static int16_t get_opus_header_gain(const char* path)
     return gain;
 }
 
+static std::string md5_to_hex(const uint8_t *md5)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    bool zero = true;
+    for (size_t i = 0; i < 16; i++) {
+        hex += digits[md5[i] >> 4];
+        hex += digits[md5[i] & 0xf];
+        zero &= !md5[i];
+    }
+    return zero ? std::string() : hex;
+}
+
+static uint32_t read_le32(const uint8_t *data)
+{
+    return (uint32_t) data[0] | (uint32_t) data[1] << 8 | (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24;
+}
+
+// The encoder writes the MD5 into a metadata sub-block of a block after the
+// audio, which is followed by the APEv2 and ID3v1 tags
+static std::string get_wavpack_md5(const char *path)
+{
+    std::unique_ptr<std::FILE, int (*)(FILE*)> file(fopen(path, "rb"), fclose);
+    if (!file || fseek(file.get(), 0L, SEEK_END))
+        return {};
+    long end = ftell(file.get());
+
+    // Skip the tags
+    uint8_t footer[32];
+    if (end >= 128 && !fseek(file.get(), end - 128, SEEK_SET) && fread(footer, 1, 3, file.get()) == 3 && !memcmp(footer, "TAG", 3))
+        end -= 128;
+    if (end >= 32 && !fseek(file.get(), end - 32, SEEK_SET) && fread(footer, 1, 32, file.get()) == 32 && !memcmp(footer, "APETAGEX", 8))
+        end -= (long) read_le32(footer + 12) + (read_le32(footer + 20) & 0x80000000 ? 32 : 0);
+    if (end < 32)
+        return {};
+
+    std::vector<uint8_t> buffer((size_t) std::min<long>(end, WAVPACK_TAIL_SIZE));
+    if (fseek(file.get(), end - (long) buffer.size(), SEEK_SET) || fread(buffer.data(), 1, buffer.size(), file.get()) != buffer.size())
+        return {};
+
+    // Search the blocks from the end. The metadata sub-blocks follow the 32 byte
+    // block header, each with an ID and a size in 16 bit words
+    for (size_t i = buffer.size() - 32 + 1; i-- > 0;) {
+        if (memcmp(&buffer[i], "wvpk", 4))
+            continue;
+        size_t block_end = i + 8 + read_le32(&buffer[i + 4]);
+        if (block_end > buffer.size())
+            continue;
+        size_t pos = i + 32;
+        while (pos + 2 <= block_end) {
+            uint8_t id = buffer[pos];
+            size_t header = 2;
+            size_t size = (size_t) buffer[pos + 1] * 2;
+            if (id & 0x80) { // ID_LARGE
+                if (pos + 4 > block_end)
+                    break;
+                header = 4;
+                size = ((size_t) buffer[pos + 1] | (size_t) buffer[pos + 2] << 8 | (size_t) buffer[pos + 3] << 16) * 2;
+            }
+            if (pos + header + size > block_end)
+                break;
+            if ((id & 0x3f) == 0x26 && size - (id & 0x40 ? 1 : 0) == 16) // ID_MD5_CHECKSUM
+                return md5_to_hex(&buffer[pos + header]);
+            pos += header + size;
+        }
+    }
+    return {};
+}
+
+// Files since version 3.98 start with a descriptor that holds the MD5
+static std::string get_ape_md5(const char *path)
+{
+    std::unique_ptr<std::FILE, int (*)(FILE*)> file(fopen(path, "rb"), fclose);
+    if (!file)
+        return {};
+
+    // Skip an ID3v2 tag in front of the file
+    uint8_t header[52];
+    long offset = 0;
+    if (fread(header, 1, 10, file.get()) == 10 && !memcmp(header, "ID3", 3)) {
+        offset = 10 + (long) ((header[6] & 0x7f) << 21 | (header[7] & 0x7f) << 14 | (header[8] & 0x7f) << 7 | (header[9] & 0x7f));
+        if (header[5] & 0x10)
+            offset += 10;
+    }
+    if (fseek(file.get(), offset, SEEK_SET)
+    || fread(header, 1, sizeof(header), file.get()) != sizeof(header)
+    || memcmp(header, "MAC ", 4)
+    || (header[4] | header[5] << 8) < 3980)
+        return {};
+    return md5_to_hex(header + 36);
+}
+
 static bool set_mpc_packet_rg(const char *path)
 {
     std::FILE *fp = fopen(path, "rb+");
@@ -36,5 +36,6 @@
 
 bool tag_track(ScanJob::Track &track, const Config &config);
 bool tag_exists(const ScanJob::Track &track);
+std::string get_audio_md5(const ScanJob::Track &track);
 bool set_opus_header_gain(const char *path, int16_t gain);
 
@@ -0,0 +1,65 @@
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <functional>
+
+#include "threadpool.hpp"
+
+ThreadPool::ThreadPool(size_t nb_threads)
+{
+    if (!nb_threads)
+        nb_threads = 1;
+    threads.reserve(nb_threads);
+    for (size_t i = 0; i < nb_threads; i++)
+        threads.emplace_back(&ThreadPool::work, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::scoped_lock lock(mutex);
+        quit = true;
+    }
+    cv.notify_all();
+    for (std::thread &thread : threads)
+        thread.join();
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+    {
+        std::scoped_lock lock(mutex);
+        tasks.push(std::move(task));
+        pending++;
+    }
+    cv.notify_one();
+}
+
+void ThreadPool::wait()
+{
+    std::unique_lock lock(mutex);
+    done_cv.wait(lock, [this]{ return !pending; });
+}
+
+void ThreadPool::work()
+{
+    using Clock = std::chrono::steady_clock;
+    std::unique_lock lock(mutex);
+    Clock::time_point mark = Clock::now();
+    while (true) {
+        cv.wait(lock, [this]{ return quit || !tasks.empty(); });
+        if (tasks.empty())
+            return;
+        std::function<void()> task = std::move(tasks.front());
+        tasks.pop();
+        lock.unlock();
+        Clock::time_point start = Clock::now();
+        idle_ns.fetch_add((uint64_t) std::chrono::nanoseconds(start - mark).count(), std::memory_order_relaxed);
+        task();
+        mark = Clock::now();
+        busy_ns.fetch_add((uint64_t) std::chrono::nanoseconds(mark - start).count(), std::memory_order_relaxed);
+        lock.lock();
+        if (!--pending)
+            done_cv.notify_all();
+    }
+}
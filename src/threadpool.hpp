@@ -0,0 +1,38 @@
+#pragma once
+
+#include <queue>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+#include <stdint.h>
+
+// A fixed set of threads that run submitted tasks in FIFO order. Tasks may
+// submit further tasks, and wait() returns once all of them have finished
+class ThreadPool {
+    public:
+        ThreadPool(size_t nb_threads);
+        ~ThreadPool();
+        void submit(std::function<void()> task);
+        void wait();
+        size_t size() const { return threads.size(); }
+
+        // Total time the threads have spent running tasks and waiting for them
+        double busy_time() const { return (double) busy_ns.load(std::memory_order_relaxed) / 1e9; }
+        double idle_time() const { return (double) idle_ns.load(std::memory_order_relaxed) / 1e9; }
+
+    private:
+        std::vector<std::thread> threads;
+        std::queue<std::function<void()>> tasks;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::condition_variable done_cv;
+        size_t pending = 0;
+        bool quit = false;
+        std::atomic<uint64_t> busy_ns = 0;
+        std::atomic<uint64_t> idle_ns = 0;
+
+        void work();
+};
@@ -0,0 +1,225 @@
+#include <mutex>
+#include <vector>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <filesystem>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#endif
+
+#include "rsgain.hpp"
+#include "scan.hpp"
+#include "traverse.hpp"
+#include "threadpool.hpp"
+#include "storage.hpp"
+
+#ifdef __linux__
+#define DIRENT_BUFFER_SIZE (64 * 1024)
+
+// Header of the records returned by getdents64(2), which glibc doesn't declare.
+// The NUL-terminated name follows d_type, before the padding of the struct
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+};
+#define DIRENT_NAME_OFFSET (offsetof(linux_dirent64, d_type) + 1)
+#endif
+
+// Walks the directory tree with one task per directory, so that subtrees are listed concurrently
+class Traversal {
+    public:
+        Traversal(size_t nb_threads, bool disk_order, bool file_sizes) : disk_order(disk_order), file_sizes(file_sizes), pool(nb_threads) {}
+        void walk(const std::filesystem::path &path, bool recurse);
+        void wait() { pool.wait(); }
+
+        std::vector<Directory> directories;
+        std::vector<std::string> errors;
+
+    private:
+        bool disk_order;
+        bool file_sizes;
+        std::mutex mutex;
+        ThreadPool pool;
+
+        void submit(std::filesystem::path path, bool recurse)
+        {
+            pool.submit([this, path = std::move(path), recurse]{ walk(path, recurse); });
+        }
+        void add(Directory &directory)
+        {
+            std::scoped_lock lock(mutex);
+            directories.push_back(std::move(directory));
+        }
+#ifndef __linux__
+        void add_file(Directory &directory, const std::filesystem::path &path, FileType type)
+        {
+            std::error_code ec;
+            directory.files.push_back({
+                .path = path,
+                .type = type,
+                .offset = disk_order ? get_physical_offset(path) : 0,
+                .size = file_sizes ? (uint64_t) std::filesystem::file_size(path, ec) : 0
+            });
+        }
+#endif
+        void add_error(const std::filesystem::path &path)
+        {
+            std::scoped_lock lock(mutex);
+            errors.push_back(path.string());
+        }
+};
+
+static FileType filetype_from_name(const char *name)
+{
+    const char *extension = strrchr(name, '.');
+    return extension && extension != name ? determine_filetype(extension) : FileType::INVALID;
+}
+
+#ifdef __linux__
+// List a directory with getdents64(2) in large batches. The file type reported in d_type
+// lets us avoid a stat() call for each entry, and names are checked for an audio file
+// extension before any metadata is looked up. Filesystems that don't fill in d_type,
+// and symbolic links, fall back to fstatat()
+void Traversal::walk(const std::filesystem::path &path, bool recurse)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        add_error(path);
+        return;
+    }
+
+    Directory directory = {.path = path, .files = {}};
+    std::unique_ptr<char[]> buffer(new char[DIRENT_BUFFER_SIZE]);
+    long nread;
+    while ((nread = syscall(SYS_getdents64, fd, buffer.get(), DIRENT_BUFFER_SIZE)) > 0) {
+        for (long pos = 0; pos < nread;) {
+            const linux_dirent64 *entry = reinterpret_cast<linux_dirent64*>(buffer.get() + pos);
+            pos += entry->d_reclen;
+            const char *name = reinterpret_cast<const char*>(entry) + DIRENT_NAME_OFFSET;
+            if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+                continue;
+
+            unsigned char type = entry->d_type;
+            FileType file_type = type == DT_DIR ? FileType::INVALID : filetype_from_name(name);
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW))
+                    continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+            }
+
+            switch (type) {
+                case DT_DIR:
+                    if (recurse)
+                        submit(path / name, true);
+                    break;
+
+                // The size is only looked up for the progress display, as it costs a stat() per file
+                case DT_REG: {
+                    struct stat st;
+                    if (file_type == FileType::INVALID)
+                        break;
+                    if (!file_sizes || fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW))
+                        st.st_size = 0;
+                    directory.files.push_back({
+                        .path = path / name,
+                        .type = file_type,
+                        .offset = disk_order ? get_physical_offset(fd, name, entry->d_ino) : 0,
+                        .size = (uint64_t) st.st_size
+                    });
+                    break;
+                }
+
+                // Symbolic links to directories are scanned but not descended into
+                case DT_LNK: {
+                    struct stat st;
+                    if (fstatat(fd, name, &st, 0))
+                        break;
+                    if (S_ISDIR(st.st_mode))
+                        submit(path / name, false);
+                    else if (S_ISREG(st.st_mode) && file_type != FileType::INVALID)
+                        directory.files.push_back({
+                            .path = path / name,
+                            .type = file_type,
+                            .offset = disk_order ? get_physical_offset(fd, name, st.st_ino) : 0,
+                            .size = (uint64_t) st.st_size
+                        });
+                    break;
+                }
+            }
+        }
+    }
+    if (nread < 0)
+        add_error(path);
+    close(fd);
+    add(directory);
+}
+
+#else
+void Traversal::walk(const std::filesystem::path &path, bool recurse)
+{
+    std::error_code ec;
+    std::filesystem::directory_iterator it(path, ec);
+    if (ec) {
+        add_error(path);
+        return;
+    }
+
+    Directory directory = {.path = path, .files = {}};
+    std::filesystem::directory_iterator end;
+    for (; it != end; it.increment(ec)) {
+        if (ec) {
+            add_error(path);
+            break;
+        }
+        const std::filesystem::directory_entry &entry = *it;
+        FileType file_type = filetype_from_name(entry.path().filename().string().c_str());
+        if (entry.is_symlink(ec)) {
+            if (entry.is_directory(ec))
+                submit(entry.path(), false);
+            else if (file_type != FileType::INVALID && entry.is_regular_file(ec))
+                add_file(directory, entry.path(), file_type);
+        }
+        else if (entry.is_directory(ec)) {
+            if (recurse)
+                submit(entry.path(), true);
+        }
+        else if (file_type != FileType::INVALID && entry.is_regular_file(ec))
+            add_file(directory, entry.path(), file_type);
+    }
+    add(directory);
+}
+#endif
+
+// Find all directories below root, along with the audio files in each of them.
+// Directories are sorted by path, or with disk_order, files and directories are
+// sorted by their position on the storage device so that the scan reads it
+// mostly sequentially. With file_sizes, the size of each file is looked up as well.
+// Directories that could not be read are returned in errors
+std::vector<Directory> traverse(const std::filesystem::path &root, size_t nb_threads, bool disk_order, bool file_sizes, std::vector<std::string> &errors)
+{
+    Traversal traversal(nb_threads, disk_order, file_sizes);
+    traversal.walk(root, true);
+    traversal.wait();
+    std::vector<Directory> &directories = traversal.directories;
+    if (disk_order) {
+        for (Directory &directory : directories)
+            std::sort(directory.files.begin(), directory.files.end(), [](const auto &a, const auto &b) { return a.offset < b.offset; });
+        auto first_offset = [](const Directory &d) { return d.files.empty() ? UINT64_MAX : d.files.front().offset; };
+        std::sort(directories.begin(), directories.end(), [&](const auto &a, const auto &b) { return first_offset(a) < first_offset(b); });
+    }
+    else
+        std::sort(directories.begin(), directories.end(), [](const auto &a, const auto &b) { return a.path < b.path; });
+    errors = std::move(traversal.errors);
+    return std::move(directories);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <filesystem>
+#include "scan.hpp"
+
+// Directory listing is dominated by latency on network storage,
+// so the traversal uses more threads than there are CPUs
+#define TRAVERSE_THREADS 16
+
+struct AudioFile {
+    std::filesystem::path path;
+    FileType type;
+    uint64_t offset; // Position on the storage device, see get_physical_offset()
+    uint64_t size;   // Only with file_sizes
+};
+
+struct Directory {
+    std::filesystem::path path;
+    std::vector<AudioFile> files;
+};
+
+std::vector<Directory> traverse(const std::filesystem::path &root, size_t nb_threads, bool disk_order, bool file_sizes, std::vector<std::string> &errors);